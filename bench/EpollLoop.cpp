@@ -0,0 +1,283 @@
+#include "EpollLoop.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <system_error>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+using namespace nev;
+
+struct EpollLoop::Watcher {
+	virtual void fire(u32 events) = 0;
+
+protected:
+	~Watcher() = default;
+};
+
+struct EpollLoop::PollImpl final : Poll, EpollLoop::Watcher {
+	EpollLoop& loop;
+	std::function<void(Poll&, int, int)> cb;
+	const int fd;
+	int events;
+	bool active;
+
+	PollImpl(EpollLoop& loop, int fd)
+	: loop(loop),
+	  cb(nullptr),
+	  fd(fd),
+	  events(0),
+	  active(false) { }
+
+	~PollImpl() {
+		stop();
+	}
+
+	bool start(int evs, std::function<void(Poll&, int, int)> f) override {
+		cb = std::move(f);
+		events = evs;
+		active = loop.watch(fd, this, evs);
+		return active;
+	}
+
+	bool change(int evs) override {
+		events = evs;
+		return active && loop.watch(fd, this, evs);
+	}
+
+	bool stop() override {
+		if (active) {
+			loop.unwatch(fd, this);
+			active = false;
+		}
+
+		return true;
+	}
+
+	void fire(u32 e) override {
+		int evs = (e & EPOLLIN ? Evt::READABLE : 0) | (e & EPOLLOUT ? Evt::WRITABLE : 0);
+		if (e & (EPOLLERR | EPOLLHUP)) {
+			evs |= events; // let the owner find the error on its next read or write
+		}
+
+		auto f = cb; // the callback can restart or destroy this poll
+		f(*this, 0, evs);
+	}
+};
+
+struct EpollLoop::AsyncImpl final : Async, EpollLoop::Watcher {
+	EpollLoop& loop;
+	std::function<void(Async&)> cb;
+	const int efd;
+
+	AsyncImpl(EpollLoop& loop, std::function<void(Async&)> f)
+	: loop(loop),
+	  cb(std::move(f)),
+	  efd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+		if (efd < 0 || !loop.watch(efd, this, Poll::Evt::READABLE)) {
+			throw std::system_error(errno, std::generic_category(), "EpollLoop::async()");
+		}
+	}
+
+	~AsyncImpl() {
+		loop.unwatch(efd, this);
+		close(efd);
+	}
+
+	void change(std::function<void(Async&)> f) override {
+		cb = std::move(f);
+	}
+
+	bool send() noexcept override {
+		u64 one = 1;
+		// EAGAIN means the counter is about to overflow, it's already signalled anyway
+		return write(efd, &one, sizeof(one)) == sizeof(one) || errno == EAGAIN;
+	}
+
+	void fire(u32) override {
+		u64 n;
+		if (read(efd, &n, sizeof(n)) != sizeof(n)) {
+			return;
+		}
+
+		auto f = cb;
+		f(*this);
+	}
+};
+
+struct EpollLoop::TimerImpl final : Timer {
+	EpollLoop& loop;
+	std::function<void(Timer&)> cb;
+	std::multimap<Clock::time_point, TimerImpl *>::iterator it;
+	u64 repeat;
+	u64 startedIn;
+	bool active;
+
+	TimerImpl(EpollLoop& loop)
+	: loop(loop),
+	  cb(nullptr),
+	  it(),
+	  repeat(0),
+	  startedIn(0),
+	  active(false) { }
+
+	~TimerImpl() {
+		stop();
+	}
+
+	bool start(std::function<void(Timer&)> f, u64 timeout, u64 rep) override {
+		cb = std::move(f);
+		repeat = rep;
+		arm(timeout);
+		return true;
+	}
+
+	bool again() override {
+		if (repeat == 0) {
+			return false;
+		}
+
+		arm(repeat);
+		return true;
+	}
+
+	bool stop() override {
+		if (active) {
+			loop.timers.erase(it);
+			active = false;
+		}
+
+		return true;
+	}
+
+	void arm(u64 ms) {
+		stop();
+		it = loop.timers.emplace(Clock::now() + std::chrono::milliseconds(ms), this);
+		startedIn = loop.pass;
+		active = true;
+	}
+};
+
+EpollLoop::EpollLoop()
+: epfd(epoll_create1(EPOLL_CLOEXEC)),
+  watchers(),
+  timers(),
+  pass(0),
+  running(false) {
+	if (epfd < 0) {
+		throw std::system_error(errno, std::generic_category(), "epoll_create1()");
+	}
+}
+
+EpollLoop::~EpollLoop() {
+	close(epfd);
+}
+
+std::unique_ptr<Poll> EpollLoop::poll(int fd, bool) {
+	return std::make_unique<PollImpl>(*this, fd);
+}
+
+std::unique_ptr<Async> EpollLoop::async(std::function<void(Async&)> cb, bool) {
+	return std::make_unique<AsyncImpl>(*this, std::move(cb));
+}
+
+std::unique_ptr<Timer> EpollLoop::timer(bool) {
+	return std::make_unique<TimerImpl>(*this);
+}
+
+void * EpollLoop::handle() {
+	return this;
+}
+
+void EpollLoop::run() {
+	running = true;
+	while (running) {
+		runOnce(std::chrono::milliseconds(1000));
+	}
+}
+
+void EpollLoop::runOnce(std::chrono::milliseconds maxWait) {
+	++pass;
+
+	auto wait = maxWait;
+	if (!timers.empty()) {
+		auto untilFirst = std::chrono::ceil<std::chrono::milliseconds>(timers.begin()->first - Clock::now());
+		wait = std::clamp(untilFirst, std::chrono::milliseconds(0), maxWait);
+	}
+
+	epoll_event evs[256];
+	int n = epoll_wait(epfd, evs, 256, static_cast<int>(wait.count()));
+	if (n < 0 && errno != EINTR) {
+		throw std::system_error(errno, std::generic_category(), "epoll_wait()");
+	}
+
+	for (int i = 0; i < n; i++) {
+		// looked up every time, an earlier callback may have stopped this one
+		auto search = watchers.find(evs[i].data.fd);
+		if (search != watchers.end()) {
+			search->second->fire(evs[i].events);
+		}
+	}
+
+	fireTimers();
+}
+
+void EpollLoop::stop() {
+	running = false;
+}
+
+bool EpollLoop::watch(int fd, Watcher * w, int events) {
+	epoll_event ev{};
+	ev.events = (events & Poll::Evt::READABLE ? u32(EPOLLIN) : 0) | (events & Poll::Evt::WRITABLE ? u32(EPOLLOUT) : 0);
+	ev.data.fd = fd;
+
+	// a watcher whose fd was closed without stopping it loses it to the new one
+	auto [it, added] = watchers.try_emplace(fd, w);
+	it->second = w;
+
+	int op = added ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+	if (epoll_ctl(epfd, op, fd, &ev) == 0) {
+		return true;
+	}
+
+	// closing the fd removed it from the epoll set, or another fd was registered with this number
+	if ((errno == ENOENT || errno == EEXIST) && epoll_ctl(epfd, errno == ENOENT ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev) == 0) {
+		return true;
+	}
+
+	watchers.erase(it);
+	return false;
+}
+
+void EpollLoop::unwatch(int fd, Watcher * w) {
+	auto search = watchers.find(fd);
+	if (search == watchers.end() || search->second != w) {
+		return;
+	}
+
+	watchers.erase(search);
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr); // fails if the fd was closed already, that's fine
+}
+
+void EpollLoop::fireTimers() {
+	auto now = Clock::now();
+	while (!timers.empty()) {
+		auto first = timers.begin();
+		TimerImpl * t = first->second;
+		// a 0ms timer restarted from its own callback would otherwise never let the loop poll again
+		if (first->first > now || t->startedIn == pass) {
+			break;
+		}
+
+		timers.erase(first);
+		t->active = false;
+		if (t->repeat > 0) {
+			t->arm(t->repeat);
+		}
+
+		auto f = t->cb;
+		f(*t);
+	}
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <unordered_map>
+
+#include "Poll.hpp"
+#include "explints.hpp"
+
+// minimal epoll backed nev::Loop for the benchmarks. everything runs on the thread calling run(),
+// except Async::send(), which can be called from anywhere
+class EpollLoop : public nev::Loop {
+	using Clock = std::chrono::steady_clock;
+
+	struct Watcher;
+	struct PollImpl;
+	struct AsyncImpl;
+	struct TimerImpl;
+
+	int epfd;
+	std::unordered_map<int, Watcher *> watchers; // by fd
+	std::multimap<Clock::time_point, TimerImpl *> timers;
+	u64 pass; // timers started during a pass only fire on the next one
+	bool running;
+
+public:
+	EpollLoop();
+	~EpollLoop();
+
+	EpollLoop(const EpollLoop&) = delete;
+	const EpollLoop& operator=(const EpollLoop&) = delete;
+
+	std::unique_ptr<nev::Poll> poll(int fd, bool fallthrough = false) override;
+	std::unique_ptr<nev::Async> async(std::function<void(nev::Async&)> cb, bool fallthrough = false) override;
+	std::unique_ptr<nev::Timer> timer(bool fallthrough = false) override;
+	void * handle() override;
+
+	void run(); // until stop() is called
+	void runOnce(std::chrono::milliseconds maxWait);
+	void stop();
+
+private:
+	bool watch(int fd, Watcher *, int events);
+	void unwatch(int fd, Watcher *);
+	void fireTimers();
+};
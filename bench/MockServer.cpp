@@ -0,0 +1,402 @@
+#include "MockServer.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <string>
+#include <system_error>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+struct MockServer::Conn {
+	std::string in;
+	std::string out;
+	u64 id;
+	int fd;
+	bool smtp;
+	bool inData; // smtp message body
+	bool waiting; // for a delayed response, nothing else is read meanwhile
+	bool closeAfterWrite;
+	bool writeWatched;
+};
+
+static int listenLoopback(u16& port) {
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		throw std::system_error(errno, std::generic_category(), "socket()");
+	}
+
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0; // any free port
+	socklen_t len = sizeof(addr);
+	if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(fd, 4096) != 0
+			|| getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &len) != 0) {
+		int err = errno;
+		::close(fd);
+		throw std::system_error(err, std::generic_category(), "bind()/listen()");
+	}
+
+	port = ntohs(addr.sin_port);
+	return fd;
+}
+
+// the header block must be lowercase already
+static sz_t contentLength(std::string_view head) {
+	sz_t pos = head.find("\r\ncontent-length:");
+	if (pos == std::string_view::npos) {
+		return 0;
+	}
+
+	const char * it = head.data() + pos + 17;
+	const char * end = head.data() + head.size();
+	while (it != end && *it == ' ') {
+		++it;
+	}
+
+	sz_t n = 0;
+	std::from_chars(it, end, n);
+	return n;
+}
+
+MockServer::MockServer()
+: epfd(epoll_create1(EPOLL_CLOEXEC)),
+  wakeFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+  httpFd(listenLoopback(httpPortNum)),
+  smtpFd(listenLoopback(smtpPortNum)),
+  conns(),
+  delayed(),
+  nextConnId(0),
+  connections(0),
+  httpRequests(0),
+  resets(0),
+  mails(0) {
+	if (epfd < 0 || wakeFd < 0) {
+		throw std::system_error(errno, std::generic_category(), "MockServer()");
+	}
+
+	for (int fd : {wakeFd, httpFd, smtpFd}) {
+		epoll_event ev{};
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+	}
+
+	thread = std::thread([this] { run(); });
+}
+
+MockServer::~MockServer() {
+	u64 one = 1;
+	if (write(wakeFd, &one, sizeof(one)) == sizeof(one)) {
+		thread.join();
+	} else {
+		thread.detach(); // can't happen with a fresh eventfd
+	}
+
+	for (int fd : {httpFd, smtpFd, wakeFd, epfd}) {
+		::close(fd);
+	}
+}
+
+u16 MockServer::httpPort() const {
+	return httpPortNum;
+}
+
+u16 MockServer::smtpPort() const {
+	return smtpPortNum;
+}
+
+std::string MockServer::httpUrl(std::string_view path) const {
+	return "http://127.0.0.1:" + std::to_string(httpPortNum) + std::string(path);
+}
+
+std::string MockServer::smtpUrl() const {
+	return "smtp://127.0.0.1:" + std::to_string(smtpPortNum);
+}
+
+MockServer::Stats MockServer::stats() const {
+	return {connections.load(), httpRequests.load(), resets.load(), mails.load()};
+}
+
+void MockServer::run() {
+	epoll_event evs[256];
+	while (true) {
+		int timeout = -1;
+		if (!delayed.empty()) {
+			auto d = std::chrono::ceil<std::chrono::milliseconds>(delayed.begin()->first - Clock::now());
+			timeout = static_cast<int>(std::max<i64>(d.count(), 0));
+		}
+
+		int n = epoll_wait(epfd, evs, 256, timeout);
+		for (int i = 0; i < n; i++) {
+			int fd = evs[i].data.fd;
+			if (fd == wakeFd) {
+				while (!conns.empty()) {
+					close(conns.begin()->second);
+				}
+
+				return;
+			} else if (fd == httpFd || fd == smtpFd) {
+				accept(fd, fd == smtpFd);
+				continue;
+			}
+
+			// looked up again after reading, the connection may be closed by then
+			auto search = conns.find(fd);
+			if (search != conns.end() && evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+				onReadable(search->second);
+				search = conns.find(fd);
+			}
+
+			if (search != conns.end() && evs[i].events & EPOLLOUT) {
+				onWritable(search->second);
+			}
+		}
+
+		sendDelayed();
+	}
+}
+
+void MockServer::accept(int listenFd, bool smtp) {
+	while (true) {
+		int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			return; // EAGAIN, or out of fds until some are closed
+		}
+
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		epoll_event ev{};
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+
+		Conn& c = conns[fd];
+		c = Conn{{}, {}, nextConnId++, fd, smtp, false, false, false, false};
+		connections.fetch_add(1, std::memory_order_relaxed);
+		if (smtp) {
+			c.out = "220 mock ESMTP\r\n";
+			onWritable(c);
+		}
+	}
+}
+
+void MockServer::onReadable(Conn& c) {
+	char buf[16384];
+	while (true) {
+		ssize_t n = read(c.fd, buf, sizeof(buf));
+		if (n > 0) {
+			c.in.append(buf, n);
+			continue;
+		}
+
+		if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+			close(c);
+			return;
+		}
+
+		if (errno != EINTR) {
+			break;
+		}
+	}
+
+	if (c.smtp ? handleSmtp(c) : handleHttp(c)) {
+		onWritable(c);
+	}
+}
+
+void MockServer::onWritable(Conn& c) {
+	while (!c.out.empty()) {
+		ssize_t n = write(c.fd, c.out.data(), c.out.size());
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			} else if (errno != EINTR) {
+				close(c);
+				return;
+			}
+
+			continue;
+		}
+
+		c.out.erase(0, n);
+	}
+
+	if (c.out.empty() && c.closeAfterWrite) {
+		close(c);
+		return;
+	}
+
+	updateEvents(c);
+}
+
+bool MockServer::handleHttp(Conn& c) {
+	while (!c.waiting) {
+		sz_t headEnd = c.in.find("\r\n\r\n");
+		if (headEnd == std::string::npos) {
+			return true;
+		}
+
+		std::string head(c.in, 0, headEnd);
+		std::transform(head.begin(), head.end(), head.begin(), [] (unsigned char ch) { return std::tolower(ch); });
+		sz_t bodyLen = contentLength(head);
+		if (c.in.size() < headEnd + 4 + bodyLen) {
+			return true;
+		}
+
+		// request line: method, target, version. the target is kept as sent, paths are lowercase anyway
+		sz_t targetStart = c.in.find(' ') + 1;
+		sz_t targetEnd = c.in.find(' ', targetStart);
+		std::string target(c.in, targetStart, targetEnd - targetStart);
+		if (target.compare(0, 7, "http://") == 0) {
+			sz_t pathStart = target.find('/', 7);
+			target.erase(0, pathStart == std::string::npos ? target.size() : pathStart);
+		}
+
+		std::string body(c.in, headEnd + 4, bodyLen);
+		c.closeAfterWrite = head.find("\r\nconnection: close") != std::string::npos;
+		c.in.erase(0, headEnd + 4 + bodyLen);
+		httpRequests.fetch_add(1, std::memory_order_relaxed);
+
+		std::string_view path(target);
+		std::string_view query;
+		if (sz_t q = path.find('?'); q != std::string_view::npos) {
+			query = path.substr(q + 1);
+			path = path.substr(0, q);
+		}
+
+		if (path == "/reset") {
+			reset(c);
+			return false;
+		} else if (path == "/slow") {
+			u64 ms = 0;
+			if (sz_t p = query.find("ms="); p != std::string_view::npos) {
+				std::from_chars(query.data() + p + 3, query.data() + query.size(), ms);
+			}
+
+			c.waiting = true;
+			delayed.emplace(Clock::now() + std::chrono::milliseconds(ms), std::make_pair(c.fd, c.id));
+		} else if (path == "/echo") {
+			respond(c, body);
+		} else if (path.compare(0, 4, "/v2/") == 0) {
+			std::string ip(path.substr(4));
+			respond(c, "{\"status\":\"ok\",\"" + ip + "\":{\"proxy\":\"no\",\"type\":\"Business\"}}", "application/json");
+		} else {
+			respond(c, "ok");
+		}
+	}
+
+	return true;
+}
+
+bool MockServer::handleSmtp(Conn& c) {
+	while (true) {
+		if (c.inData) {
+			// the terminator includes the line break ending the message, unless it's empty
+			sz_t end = c.in.compare(0, 3, ".\r\n") == 0 ? 0 : c.in.find("\r\n.\r\n");
+			if (end == std::string::npos) {
+				return true;
+			}
+
+			c.in.erase(0, end == 0 ? 3 : end + 5);
+			c.inData = false;
+			mails.fetch_add(1, std::memory_order_relaxed);
+			c.out += "250 OK queued\r\n";
+			continue;
+		}
+
+		sz_t eol = c.in.find("\r\n");
+		if (eol == std::string::npos) {
+			return true;
+		}
+
+		std::string verb(c.in, 0, std::min<sz_t>(eol, 4));
+		std::transform(verb.begin(), verb.end(), verb.begin(), [] (unsigned char ch) { return std::toupper(ch); });
+		c.in.erase(0, eol + 2);
+
+		if (verb == "EHLO" || verb == "HELO") {
+			c.out += "250 mock\r\n";
+		} else if (verb == "MAIL" || verb == "RCPT" || verb == "RSET" || verb == "NOOP") {
+			c.out += "250 OK\r\n";
+		} else if (verb == "DATA") {
+			c.out += "354 End data with <CR><LF>.<CR><LF>\r\n";
+			c.inData = true;
+		} else if (verb == "QUIT") {
+			c.out += "221 Bye\r\n";
+			c.closeAfterWrite = true;
+			return true;
+		} else {
+			c.out += "502 Command not implemented\r\n";
+		}
+	}
+}
+
+void MockServer::respond(Conn& c, std::string_view body, std::string_view contentType) {
+	c.out += "HTTP/1.1 200 OK\r\nContent-Type: ";
+	c.out += contentType;
+	c.out += "\r\nContent-Length: ";
+	c.out += std::to_string(body.size());
+	c.out += c.closeAfterWrite ? "\r\nConnection: close\r\n\r\n" : "\r\n\r\n";
+	c.out += body;
+}
+
+void MockServer::reset(Conn& c) {
+	// closing with a zero linger time sends a RST instead of a FIN
+	linger l{1, 0};
+	setsockopt(c.fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+	resets.fetch_add(1, std::memory_order_relaxed);
+	close(c);
+}
+
+void MockServer::close(Conn& c) {
+	int fd = c.fd;
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+	::close(fd);
+	conns.erase(fd);
+}
+
+void MockServer::sendDelayed() {
+	auto now = Clock::now();
+	while (!delayed.empty() && delayed.begin()->first <= now) {
+		auto [fd, id] = delayed.begin()->second;
+		delayed.erase(delayed.begin());
+
+		// the client may have given up and closed it, the fd could belong to another connection now
+		auto search = conns.find(fd);
+		if (search == conns.end() || search->second.id != id) {
+			continue;
+		}
+
+		Conn& c = search->second;
+		c.waiting = false;
+		respond(c, "ok");
+		if (handleHttp(c)) {
+			onWritable(c);
+		}
+	}
+}
+
+void MockServer::updateEvents(Conn& c) {
+	bool wantsWrite = !c.out.empty();
+	if (wantsWrite == c.writeWatched) {
+		return;
+	}
+
+	epoll_event ev{};
+	ev.events = EPOLLIN | (wantsWrite ? u32(EPOLLOUT) : 0);
+	ev.data.fd = c.fd;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, c.fd, &ev);
+	c.writeWatched = wantsWrite;
+}
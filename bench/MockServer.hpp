@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+#include "explints.hpp"
+
+// loopback HTTP/1.1 and SMTP stand-in for the AsyncCurl benchmarks, served from its own thread.
+// HTTP paths:
+//   /fast          200 right away
+//   /slow?ms=N     200 after N milliseconds
+//   /reset         the connection is reset once the request is read
+//   /echo          the request body is sent back
+//   /v2/<ip>       proxycheck.io style JSON saying the ip isn't a proxy
+// proxy style requests (GET http://host/path) are served like the path alone.
+// SMTP accepts every mail after the usual EHLO, MAIL, RCPT and DATA exchange
+class MockServer {
+public:
+	struct Stats {
+		u64 connections;
+		u64 httpRequests;
+		u64 resets;
+		u64 mails;
+	};
+
+private:
+	using Clock = std::chrono::steady_clock;
+
+	struct Conn;
+
+	int epfd;
+	int wakeFd;
+	int httpFd;
+	int smtpFd;
+	u16 httpPortNum;
+	u16 smtpPortNum;
+	std::unordered_map<int, Conn> conns;
+	std::multimap<Clock::time_point, std::pair<int, u64>> delayed; // fd and connection id, for /slow
+	u64 nextConnId;
+	std::atomic<u64> connections;
+	std::atomic<u64> httpRequests;
+	std::atomic<u64> resets;
+	std::atomic<u64> mails;
+	std::thread thread;
+
+public:
+	MockServer();
+	~MockServer();
+
+	MockServer(const MockServer&) = delete;
+	const MockServer& operator=(const MockServer&) = delete;
+
+	u16 httpPort() const;
+	u16 smtpPort() const;
+	std::string httpUrl(std::string_view path) const;
+	std::string smtpUrl() const;
+	Stats stats() const;
+
+private:
+	void run();
+	void accept(int listenFd, bool smtp);
+	void onReadable(Conn&);
+	void onWritable(Conn&);
+	bool handleHttp(Conn&);
+	bool handleSmtp(Conn&);
+	void respond(Conn&, std::string_view body, std::string_view contentType = "text/plain");
+	void reset(Conn&);
+	void close(Conn&);
+	void sendDelayed();
+	void updateEvents(Conn&);
+};
@@ -0,0 +1,212 @@
+// AsyncCurl against a loopback mock server, through a real nev::Loop.
+// usage: curl_bench [scenario...], runs all of them by default. exits with 1 if any scenario
+// had unexpected results (failures where there should be none, or the other way around)
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <malloc.h>
+
+#include "AsyncCurl.hpp"
+#include "Ip.hpp"
+#include "ProxycheckioRestApi.hpp"
+#include "TimedCallbacks.hpp"
+#include "explints.hpp"
+
+#include "EpollLoop.hpp"
+#include "MockServer.hpp"
+
+#include <nlohmann/json.hpp>
+
+using namespace std::chrono_literals;
+using Clock = std::chrono::steady_clock;
+
+struct Run;
+
+struct Scenario {
+	const char * name;
+	sz_t total;
+	sz_t concurrency; // requests kept in flight
+	long connections; // per host limit
+	bool expectFailures;
+	std::function<void(Run&, sz_t)> issue; // must call Run::finished(i, ok) once done
+};
+
+struct Run {
+	EpollLoop& loop;
+	const Scenario& s;
+	std::vector<Clock::time_point> started;
+	std::vector<u64> latencies; // microseconds
+	sz_t issued = 0;
+	sz_t done = 0;
+	sz_t ok = 0;
+
+	Run(EpollLoop& loop, const Scenario& s)
+	: loop(loop),
+	  s(s),
+	  started(s.total) {
+		latencies.reserve(s.total);
+	}
+
+	void issueNext() {
+		sz_t i = issued++;
+		started[i] = Clock::now();
+		s.issue(*this, i);
+	}
+
+	void finished(sz_t i, bool success) {
+		latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - started[i]).count());
+		ok += success;
+		if (++done == s.total) {
+			loop.stop();
+		} else if (issued < s.total) {
+			issueNext();
+		}
+	}
+};
+
+static sz_t heapInUse() {
+	struct mallinfo2 mi = mallinfo2();
+	return mi.uordblks + mi.hblkhd;
+}
+
+static double percentileMs(const std::vector<u64>& sorted, double p) {
+	if (sorted.empty()) {
+		return 0;
+	}
+
+	return sorted[std::min<sz_t>(sorted.size() - 1, static_cast<sz_t>(p * sorted.size()))] / 1000.0;
+}
+
+int main(int argc, char ** argv) {
+	// the scenarios talk to the mock server directly, except the proxycheck one
+	for (const char * v : {"http_proxy", "HTTP_PROXY", "all_proxy", "ALL_PROXY", "no_proxy", "NO_PROXY"}) {
+		unsetenv(v);
+	}
+
+	EpollLoop loop;
+	TimedCallbacks tc(loop);
+	MockServer server;
+	AsyncCurl ac(loop);
+	ProxycheckioRestApi proxycheck(ac, tc, "benchkey");
+
+	const std::string fastUrl = server.httpUrl("/fast");
+	const std::string echoUrl = server.httpUrl("/echo");
+	const std::string resetUrl = server.httpUrl("/reset");
+	const std::string smtpUrl = server.smtpUrl();
+	const std::string body(1024, 'x');
+
+	auto get = [&ac] (const std::string& url) {
+		return [&ac, &url] (Run& r, sz_t i) {
+			AsyncCurl::Request req(url);
+			req.setTimeout(10s);
+			ac.request(std::move(req), [&r, i] (AsyncCurl::Result res) {
+				r.finished(i, res.successful && res.responseCode == 200);
+			});
+		};
+	};
+
+	auto slow = [&ac, &server] (int ms) {
+		return [&ac, url{server.httpUrl("/slow?ms=" + std::to_string(ms))}] (Run& r, sz_t i) {
+			AsyncCurl::Request req(url);
+			req.setTimeout(30s);
+			ac.request(std::move(req), [&r, i] (AsyncCurl::Result res) {
+				r.finished(i, res.successful && res.responseCode == 200);
+			});
+		};
+	};
+
+	std::vector<Scenario> scenarios{
+		{"fast", 20000, 64, 16, false, get(fastUrl)},
+		{"post1k", 10000, 64, 16, false, [&] (Run& r, sz_t i) {
+			AsyncCurl::Request req(echoUrl);
+			req.setBody(body, "application/octet-stream");
+			req.setTimeout(10s);
+			ac.request(std::move(req), [&r, i, n{body.size()}] (AsyncCurl::Result res) {
+				r.finished(i, res.successful && res.data.size() == n);
+			});
+		}},
+		{"slow100ms", 2000, 500, 500, false, slow(100)},
+		{"reset", 1000, 32, 16, true, get(resetUrl)},
+		{"burst10k", 10000, 10000, 256, false, slow(20)},
+		{"smtp", 1000, 16, 16, false, [&] (Run& r, sz_t i) {
+			ac.smtpSendMail(smtpUrl, "bench@localhost", "rcpt@localhost", "mail " + std::to_string(i), "hello\r\n",
+					[&r, i] (AsyncCurl::Result res) {
+				r.finished(i, res.successful);
+			});
+		}},
+		{"proxycheck", 2000, 64, 16, false, [&] (Run& r, sz_t i) {
+			// every ip is different, so none of them come from the cache
+			proxycheck.check(Ip(u32(10) | u32(i + 1) << 8), [&r, i] (std::optional<bool> isProxy, nlohmann::json) {
+				r.finished(i, isProxy.has_value() && !*isProxy);
+			});
+		}},
+	};
+
+	std::printf("%-11s %8s %8s %8s %7s %10s %8s %8s %8s %12s\n", "scenario", "requests", "ok", "failed", "conns",
+		"req/s", "p50 ms", "p99 ms", "max ms", "heap/pending");
+
+	bool unexpected = false;
+	for (const auto& s : scenarios) {
+		if (argc > 1 && std::none_of(argv + 1, argv + argc, [&s] (const char * a) { return std::strcmp(a, s.name) == 0; })) {
+			continue;
+		}
+
+		AsyncCurl::Tuning t;
+		t.maxHostConnections = s.connections;
+		t.maxTotalConnections = s.connections;
+		t.maxConnects = s.connections;
+		t.maxIdleHandles = std::min<sz_t>(s.concurrency, 1024);
+		ac.setTuning(t);
+
+		if (std::strcmp(s.name, "proxycheck") == 0) {
+			// the api's url is fixed, so the mock server is set as its proxy instead. curl reads this per transfer
+			setenv("http_proxy", server.httpUrl("").c_str(), 1);
+		}
+
+		Run r(loop, s);
+		MockServer::Stats before = server.stats();
+		sz_t heapBefore = heapInUse();
+		auto begin = Clock::now();
+
+		// the heap is measured before the loop runs, while every request of the first batch is still pending
+		sz_t initial = std::min(s.concurrency, s.total);
+		for (sz_t n = 0; n < initial; n++) {
+			r.issueNext();
+		}
+
+		i64 heapPerPending = (static_cast<i64>(heapInUse()) - static_cast<i64>(heapBefore)) / static_cast<i64>(initial);
+		loop.run();
+
+		double secs = std::chrono::duration<double>(Clock::now() - begin).count();
+		unsetenv("http_proxy");
+
+		std::sort(r.latencies.begin(), r.latencies.end());
+		sz_t failed = s.total - r.ok;
+		std::printf("%-11s %8zu %8zu %8zu %7llu %10.0f %8.2f %8.2f %8.2f %12lld\n", s.name, s.total, r.ok, failed,
+			static_cast<unsigned long long>(server.stats().connections - before.connections), s.total / secs,
+			percentileMs(r.latencies, 0.5), percentileMs(r.latencies, 0.99), percentileMs(r.latencies, 1.0),
+			static_cast<long long>(heapPerPending));
+
+		if (s.expectFailures ? r.ok != 0 : failed != 0) {
+			std::printf("  unexpected: %s\n", s.expectFailures ? "requests succeeded" : "requests failed");
+			unexpected = true;
+		}
+	}
+
+	AsyncCurl::HandlePoolStats ps = ac.handlePoolStats();
+	MockServer::Stats ss = server.stats();
+	std::printf("\neasy handle pool: %llu hits, %llu misses\n", static_cast<unsigned long long>(ps.hits),
+		static_cast<unsigned long long>(ps.misses));
+	std::printf("mock server: %llu connections, %llu http requests, %llu resets, %llu mails\n",
+		static_cast<unsigned long long>(ss.connections), static_cast<unsigned long long>(ss.httpRequests),
+		static_cast<unsigned long long>(ss.resets), static_cast<unsigned long long>(ss.mails));
+
+	return unexpected ? 1 : 0;
+}
@@ -0,0 +1,161 @@
+// floods TaskBuffer::runInMainThread() from worker threads, and drives the loop until every task ran.
+// usage: taskbuffer_bench [tasks] [workers], 200000 tasks from 2 workers by default.
+// a 1ms timer runs next to the flood, its lateness shows how long other events waited.
+// exits with 1 if any task was lost
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <time.h>
+
+#include "TaskBuffer.hpp"
+#include "explints.hpp"
+
+#include "EpollLoop.hpp"
+
+using namespace std::chrono_literals;
+using Clock = std::chrono::steady_clock;
+
+// counts how often the TaskBuffer signals the loop, and how often the loop calls it back
+class CountingLoop : public EpollLoop {
+	struct CountedAsync final : nev::Async {
+		std::unique_ptr<nev::Async> inner;
+		std::atomic<u64>& sends;
+
+		CountedAsync(std::unique_ptr<nev::Async> inner, std::atomic<u64>& sends)
+		: inner(std::move(inner)),
+		  sends(sends) { }
+
+		void change(std::function<void(nev::Async&)> cb) override {
+			inner->change(std::move(cb));
+		}
+
+		bool send() noexcept override {
+			sends.fetch_add(1, std::memory_order_relaxed);
+			return inner->send();
+		}
+	};
+
+public:
+	std::atomic<u64> sends{0};
+	u64 wakeups = 0;
+
+	std::unique_ptr<nev::Async> async(std::function<void(nev::Async&)> cb, bool fallthrough = false) override {
+		auto counted = [this, cb{std::move(cb)}] (nev::Async& a) {
+			++wakeups;
+			cb(a);
+		};
+
+		return std::make_unique<CountedAsync>(EpollLoop::async(std::move(counted), fallthrough), sends);
+	}
+};
+
+static double threadCpuMs() {
+	timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+struct Result {
+	u64 sends;
+	u64 wakeups;
+	u64 passes; // loop iterations that ran main thread tasks
+	double maxPassMs; // wall clock, includes time the workers had the core
+	double maxPassCpuMs; // spent on the main thread
+	double maxTimerLateMs;
+	double secs;
+	sz_t ran;
+};
+
+static Result flood(sz_t total, sz_t numWorkers, std::chrono::microseconds budget) {
+	CountingLoop loop;
+	TaskBuffer tb(loop, numWorkers);
+	tb.setMainThreadBudget(budget);
+
+	sz_t ran = 0; // main thread only
+	u64 sink = 0;
+	Result res{};
+
+	auto probe = loop.timer();
+	auto lastTick = Clock::now();
+	probe->start([&] (nev::Timer&) {
+		auto now = Clock::now();
+		res.maxTimerLateMs = std::max(res.maxTimerLateMs, std::chrono::duration<double, std::milli>(now - lastTick - 1ms).count());
+		lastTick = now;
+	}, 1, 1);
+
+	auto begin = Clock::now();
+	for (sz_t w = 0; w < numWorkers; w++) {
+		sz_t count = total / numWorkers + (w < total % numWorkers);
+		tb.queue([count, &ran, &sink] (TaskBuffer& tb) {
+			for (sz_t i = 0; i < count; i++) {
+				tb.runInMainThread([i, &ran, &sink] (TaskBuffer&) {
+					// a bit of work, like handling a result would
+					u64 h = i;
+					for (int k = 0; k < 512; k++) {
+						h = h * 6364136223846793005ull + 1442695040888963407ull;
+					}
+
+					sink += h;
+					++ran;
+				});
+			}
+		});
+	}
+
+	while (ran < total && Clock::now() - begin < 60s) {
+		sz_t before = ran;
+		auto start = Clock::now();
+		double startCpu = threadCpuMs();
+		loop.runOnce(100ms);
+		if (ran != before) {
+			++res.passes;
+			res.maxPassMs = std::max(res.maxPassMs, std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+			res.maxPassCpuMs = std::max(res.maxPassCpuMs, threadCpuMs() - startCpu);
+		}
+	}
+
+	res.secs = std::chrono::duration<double>(Clock::now() - begin).count();
+	probe->stop();
+	tb.prepareForDestruction();
+
+	res.sends = loop.sends;
+	res.wakeups = loop.wakeups;
+	res.ran = ran;
+	if (sink == 42) {
+		std::printf(" "); // keeps the work from being optimized out
+	}
+
+	return res;
+}
+
+int main(int argc, char ** argv) {
+	sz_t total = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 200000;
+	sz_t numWorkers = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 2;
+	if (total == 0 || numWorkers == 0) {
+		std::fprintf(stderr, "usage: %s [tasks] [workers]\n", argv[0]);
+		return 2;
+	}
+
+	std::printf("%-10s %8s %8s %8s %8s %8s %12s %12s %13s %10s\n", "budget", "tasks", "ran", "sends", "wakeups",
+		"passes", "max pass ms", "max cpu ms", "timer late ms", "tasks/s");
+
+	bool lost = false;
+	for (auto budget : {std::chrono::microseconds(5000), std::chrono::microseconds::zero()}) {
+		Result r = flood(total, numWorkers, budget);
+		std::string name = budget.count() ? std::to_string(budget.count()) + "us" : "unbounded";
+		std::printf("%-10s %8zu %8zu %8llu %8llu %8llu %12.2f %12.2f %13.2f %10.0f\n", name.c_str(), total, r.ran,
+			static_cast<unsigned long long>(r.sends), static_cast<unsigned long long>(r.wakeups),
+			static_cast<unsigned long long>(r.passes), r.maxPassMs, r.maxPassCpuMs, r.maxTimerLateMs, r.ran / r.secs);
+
+		lost |= r.ran != total;
+	}
+
+	return lost ? 1 : 0;
+}
@@ -31,6 +31,8 @@ static struct CurlRaii {
 static int noopWriter(char *, std::size_t s, std::size_t n, void *) { return s * n; }
 static int noopReader(char *, std::size_t, std::size_t, void *) { return 0; }
 
+static const char * const cancelledError = "Request cancelled";
+
 
 static inline int curlEvToNev(int curlEvents) {
 	using Evt = Poll::Evt;
@@ -45,33 +47,41 @@ static inline int nevToCurl(int nevEvents) {
 }
 
 class CurlHandle {
+	AsyncCurl * owner;
 	CURLM * multiHandle;
 	CURL * easyHandle;
+	AsyncCurl::HostStats * host;
+	u64 id;
+	std::optional<std::stop_callback<std::function<void(void)>>> stopCb;
 
 public:
-	CurlHandle(CURLM *);
+	CurlHandle(AsyncCurl *); // takes an easy handle from owner's pool, if any
 	virtual ~CurlHandle();
 
 	CURL * getHandle();
 
 protected:
 	virtual bool finished(CURLcode result); /* Returns false if error occurred */
+	virtual void cancelled();
+	void applyTuning(const AsyncCurl::Tuning&);
 	void addToMultiHandle();
 
 	friend AsyncCurl;
 };
 
 class CurlHttpHandle : public CurlHandle {
+	AsyncCurl::Request req; // keeps the url and body alive while curl uses them
+	std::unique_ptr<curl_slist, void(*)(curl_slist *)> headers;
 	std::string writeBuffer;
 	std::function<void(AsyncCurl::Result)> onFinished;
 
 public:
-	CurlHttpHandle(CURLM *, std::string, std::unordered_map<std::string_view, std::string_view>,
-		std::function<void(AsyncCurl::Result)>);
+	CurlHttpHandle(AsyncCurl&, AsyncCurl::Request, std::function<void(AsyncCurl::Result)>);
 
 private:
 	bool finished(CURLcode result);
-	static sz_t writer(char *, sz_t, sz_t, std::string *);
+	void cancelled();
+	static sz_t writer(char *, sz_t, sz_t, CurlHttpHandle *);
 };
 
 class CurlSmtpHandle : public CurlHandle {
@@ -81,11 +91,12 @@ class CurlSmtpHandle : public CurlHandle {
 	std::function<void(AsyncCurl::Result)> onFinished;
 
 public:
-	CurlSmtpHandle(CURLM *, const std::string& url, const std::string& from, const std::string& to,
+	CurlSmtpHandle(AsyncCurl&, const std::string& url, const std::string& from, const std::string& to,
 		const std::string& subject, const std::string& message, const std::string& smtpSenderName, std::function<void(AsyncCurl::Result)>);
 
 private:
 	bool finished(CURLcode result);
+	void cancelled();
 	static sz_t reader(char *, sz_t, sz_t, CurlSmtpHandle *);
 };
 
@@ -95,9 +106,135 @@ AsyncCurl::Result::Result(long httpResp, std::string data, const char * err)
   data(std::move(data)),
   errorString(err) { }
 
-CurlHandle::CurlHandle(CURLM * mHdl)
-: multiHandle(mHdl),
-  easyHandle(curl_easy_init()) {
+AsyncCurl::Request::Request(std::string url)
+: url(std::move(url)),
+  timeout(0),
+  connectTimeout(0),
+  deadline(),
+  hasParams(this->url.find('?') != std::string::npos),
+  hasBody(false) { }
+
+AsyncCurl::Request& AsyncCurl::Request::setMethod(std::string m) {
+	method = std::move(m);
+	return *this;
+}
+
+AsyncCurl::Request& AsyncCurl::Request::addParams(const std::unordered_map<std::string_view, std::string_view>& params) {
+	for (const auto& param : params) {
+		url += hasParams ? '&' : '?';
+		hasParams = true;
+		url += param.first; // should this be escaped as well?
+		url += '=';
+		url += AsyncCurl::urlEscape(param.second);
+	}
+
+	return *this;
+}
+
+AsyncCurl::Request& AsyncCurl::Request::addHeader(std::string_view name, std::string_view value) {
+	std::string& h = headers.emplace_back(name);
+	h += ": ";
+	h += value;
+	return *this;
+}
+
+AsyncCurl::Request& AsyncCurl::Request::setBody(std::string b, std::string_view contentType) {
+	body = std::move(b);
+	hasBody = true;
+	if (!contentType.empty()) {
+		addHeader("Content-Type", contentType);
+	}
+
+	return *this;
+}
+
+AsyncCurl::Request& AsyncCurl::Request::setFormBody(const std::unordered_map<std::string_view, std::string_view>& fields) {
+	std::string b;
+	for (const auto& field : fields) {
+		if (!b.empty()) {
+			b += '&';
+		}
+
+		b += AsyncCurl::urlEscape(field.first);
+		b += '=';
+		b += AsyncCurl::urlEscape(field.second);
+	}
+
+	return setBody(std::move(b), "application/x-www-form-urlencoded");
+}
+
+AsyncCurl::Request& AsyncCurl::Request::setTimeout(std::chrono::milliseconds t) {
+	timeout = t;
+	return *this;
+}
+
+AsyncCurl::Request& AsyncCurl::Request::setConnectTimeout(std::chrono::milliseconds t) {
+	connectTimeout = t;
+	return *this;
+}
+
+AsyncCurl::Request& AsyncCurl::Request::setDeadline(std::chrono::steady_clock::time_point d) {
+	deadline = d;
+	return *this;
+}
+
+AsyncCurl::Request& AsyncCurl::Request::onData(std::function<bool(std::string_view)> f) {
+	dataCb = std::move(f);
+	return *this;
+}
+
+AsyncCurl::Handle::Handle()
+: ac(nullptr),
+  id(0) { }
+
+AsyncCurl::Handle::Handle(AsyncCurl& ac, u64 id)
+: ac(&ac),
+  id(id) { }
+
+void AsyncCurl::Handle::cancel() const {
+	if (ac) {
+		ac->cancelRequest(id);
+	}
+}
+
+bool AsyncCurl::Handle::isPending() const {
+	return ac && ac->pendingRequests.count(id);
+}
+
+u64 AsyncCurl::Handle::getId() const {
+	return id;
+}
+
+AsyncCurl::Handle::operator bool() const {
+	return ac != nullptr;
+}
+
+AsyncCurl::RequestAwaiter::RequestAwaiter(AsyncCurl& ac, Request req, std::stop_token st)
+: ac(ac),
+  req(std::move(req)),
+  st(std::move(st)) { }
+
+bool AsyncCurl::RequestAwaiter::await_ready() const noexcept {
+	return false;
+}
+
+void AsyncCurl::RequestAwaiter::await_suspend(std::coroutine_handle<> h) {
+	ac.request(std::move(*req), std::move(st), [this, h] (AsyncCurl::Result r) {
+		res.emplace(std::move(r));
+		h.resume();
+	});
+}
+
+AsyncCurl::Result AsyncCurl::RequestAwaiter::await_resume() {
+	return std::move(*res);
+}
+
+CurlHandle::CurlHandle(AsyncCurl * ac)
+: owner(ac),
+  multiHandle(ac ? ac->multiHandle : nullptr),
+  easyHandle(ac ? ac->acquireEasyHandle() : curl_easy_init()),
+  host(nullptr),
+  id(0) {
 	if (!easyHandle) {
 		throw std::bad_alloc();
 	}
@@ -109,7 +246,6 @@ CurlHandle::CurlHandle(CURLM * mHdl)
 	//ec(curl_easy_setopt(easyHandle, CURLOPT_TIMEOUT, 60)); // idk if this caused any problems
 	//ec(curl_easy_setopt(easyHandle, CURLOPT_TCP_FASTOPEN, 1)); // makes http requests fail?
 	ec(curl_easy_setopt(easyHandle, CURLOPT_TCP_NODELAY, 0));
-	ec(curl_easy_setopt(easyHandle, CURLOPT_PIPEWAIT, 1));
 	//ec(curl_easy_setopt(easyHandle, CURLOPT_VERBOSE, 1));
 }
 
@@ -117,7 +253,12 @@ CurlHandle::~CurlHandle() {
 	if (multiHandle) {
 		mc(curl_multi_remove_handle(multiHandle, easyHandle));
 	}
-	curl_easy_cleanup(easyHandle);
+
+	if (owner) {
+		owner->releaseEasyHandle(easyHandle);
+	} else {
+		curl_easy_cleanup(easyHandle);
+	}
 }
 
 CURL * CurlHandle::getHandle() {
@@ -126,26 +267,79 @@ CURL * CurlHandle::getHandle() {
 
 bool CurlHandle::finished(CURLcode result) { return true; }
 
+void CurlHandle::cancelled() { }
+
+void CurlHandle::applyTuning(const AsyncCurl::Tuning& t) {
+	ec(curl_easy_setopt(easyHandle, CURLOPT_DNS_CACHE_TIMEOUT, static_cast<long>(t.dnsCacheTimeout.count())));
+	ec(curl_easy_setopt(easyHandle, CURLOPT_TIMEOUT_MS, static_cast<long>(t.timeout.count())));
+	ec(curl_easy_setopt(easyHandle, CURLOPT_CONNECTTIMEOUT_MS, static_cast<long>(t.connectTimeout.count())));
+	ec(curl_easy_setopt(easyHandle, CURLOPT_TCP_KEEPALIVE, t.tcpKeepAlive ? 1L : 0L));
+	if (t.tcpKeepAlive) {
+		ec(curl_easy_setopt(easyHandle, CURLOPT_TCP_KEEPIDLE, static_cast<long>(t.keepAliveIdle.count())));
+		ec(curl_easy_setopt(easyHandle, CURLOPT_TCP_KEEPINTVL, static_cast<long>(t.keepAliveInterval.count())));
+	}
+
+#if LIBCURL_VERSION_NUM >= 0x074100 // 7.65.0
+	ec(curl_easy_setopt(easyHandle, CURLOPT_MAXAGE_CONN, static_cast<long>(t.maxConnectionAge.count())));
+#endif
+
+	// only wait for a multiplexable connection if it can be used
+	ec(curl_easy_setopt(easyHandle, CURLOPT_PIPEWAIT, t.multiplex ? 1L : 0L));
+}
+
 void CurlHandle::addToMultiHandle() {
 	mc(curl_multi_add_handle(multiHandle, easyHandle));
 }
 
 
-CurlHttpHandle::CurlHttpHandle(CURLM * mHdl, std::string url, std::unordered_map<std::string_view, std::string_view> params, std::function<void(AsyncCurl::Result)> cb)
-: CurlHandle(mHdl),
+CurlHttpHandle::CurlHttpHandle(AsyncCurl& ac, AsyncCurl::Request r, std::function<void(AsyncCurl::Result)> cb)
+: CurlHandle(&ac),
+  req(std::move(r)),
+  headers(nullptr, curl_slist_free_all),
   onFinished(std::move(cb)) {
-	bool first = true;
-	for (const auto& param : params) {
-		url += first ? '?' : '&';
-		first = false;
-		url += param.first; // should this be escaped as well?
-		url += '=';
-		url += AsyncCurl::urlEscape(param.second);
+	CURL * curl = getHandle();
+	applyTuning(ac.getTuning());
+	ec(curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &CurlHttpHandle::writer));
+	ec(curl_easy_setopt(curl, CURLOPT_WRITEDATA, this));
+	ec(curl_easy_setopt(curl, CURLOPT_URL, req.url.c_str()));
+
+	for (const auto& h : req.headers) {
+		curl_slist * l = curl_slist_append(headers.get(), h.c_str());
+		if (!l) {
+			throw std::bad_alloc();
+		}
+
+		headers.release();
+		headers.reset(l);
 	}
 
-	ec(curl_easy_setopt(getHandle(), CURLOPT_WRITEFUNCTION, &CurlHttpHandle::writer));
-	ec(curl_easy_setopt(getHandle(), CURLOPT_WRITEDATA, &writeBuffer));
-	ec(curl_easy_setopt(getHandle(), CURLOPT_URL, url.c_str()));
+	if (headers) {
+		ec(curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers.get()));
+	}
+
+	if (req.hasBody) { // an empty body is still sent, with a Content-Length of 0
+		ec(curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(req.body.size())));
+		ec(curl_easy_setopt(curl, CURLOPT_POSTFIELDS, req.body.data()));
+	}
+
+	if (!req.method.empty()) {
+		ec(curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, req.method.c_str()));
+	}
+
+	auto timeout = req.timeout;
+	if (req.deadline != std::chrono::steady_clock::time_point{}) {
+		// at least 1ms, 0 would mean no timeout
+		auto left = std::max(std::chrono::duration_cast<std::chrono::milliseconds>(req.deadline - std::chrono::steady_clock::now()), std::chrono::milliseconds(1));
+		timeout = timeout.count() > 0 ? std::min(timeout, left) : left;
+	}
+
+	if (timeout.count() > 0) {
+		ec(curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, static_cast<long>(timeout.count())));
+	}
+
+	if (req.connectTimeout.count() > 0) {
+		ec(curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, static_cast<long>(req.connectTimeout.count())));
+	}
 
 	addToMultiHandle();
 }
@@ -161,20 +355,28 @@ bool CurlHttpHandle::finished(CURLcode result) {
 	return successful;
 }
 
-sz_t CurlHttpHandle::writer(char * data, std::size_t size, std::size_t nmemb, std::string * writerData) {
-	// writerData will never be null
-	writerData->append(data, size * nmemb);
+void CurlHttpHandle::cancelled() {
+	onFinished({-1, std::move(writeBuffer), cancelledError});
+}
+
+sz_t CurlHttpHandle::writer(char * data, std::size_t size, std::size_t nmemb, CurlHttpHandle * h) {
+	if (h->req.dataCb) {
+		// returning less than the size passed aborts the transfer
+		return h->req.dataCb({data, size * nmemb}) ? size * nmemb : 0;
+	}
 
+	h->writeBuffer.append(data, size * nmemb);
 	return size * nmemb;
 }
 
-CurlSmtpHandle::CurlSmtpHandle(CURLM * mHdl, const std::string& url, const std::string& from, const std::string& to,
+CurlSmtpHandle::CurlSmtpHandle(AsyncCurl& ac, const std::string& url, const std::string& from, const std::string& to,
 		const std::string& subject, const std::string& message, const std::string& smtpSenderName, std::function<void(AsyncCurl::Result)> cb)
-: CurlHandle(mHdl),
+: CurlHandle(&ac),
   mailRcpts(curl_slist_append(nullptr, to.c_str()), curl_slist_free_all),
   amountSent(0),
   onFinished(std::move(cb)) {
 	CURL * curl = getHandle();
+	applyTuning(ac.getTuning());
 	ec(curl_easy_setopt(curl, CURLOPT_URL, url.c_str()));
 	ec(curl_easy_setopt(curl, CURLOPT_MAIL_FROM, from.c_str()));
 	ec(curl_easy_setopt(curl, CURLOPT_MAIL_RCPT, mailRcpts.get()));
@@ -220,6 +422,10 @@ bool CurlSmtpHandle::finished(CURLcode result) {
 	return successful;
 }
 
+void CurlSmtpHandle::cancelled() {
+	onFinished({-1, {}, cancelledError});
+}
+
 sz_t CurlSmtpHandle::reader(char * buf, std::size_t size, std::size_t nmemb, CurlSmtpHandle * d) {
 	sz_t off = d->amountSent;
 	sz_t toRead = std::min(size * nmemb, d->readBuffer.size() - off);
@@ -231,20 +437,31 @@ sz_t CurlSmtpHandle::reader(char * buf, std::size_t size, std::size_t nmemb, Cur
 }
 
 AsyncCurl::AsyncCurl(Loop& loop)
+: AsyncCurl(loop, Tuning{}) { }
+
+AsyncCurl::AsyncCurl(Loop& loop, Tuning t)
 : localSmtpUrl("smtp://localhost/" + std::string(getDomainname())),
   loop(loop),
   timer(loop.timer(true)),
   multiHandle(curl_multi_init()),
   handleCount(0),
-  isTimerRunning(false) {
+  nextRequestId(1),
+  isTimerRunning(false),
+  completionScheduled(false),
+  tuning(std::move(t)) {
 	if (!multiHandle) {
 		throw std::bad_alloc();
 	}
 
-	mc(curl_multi_setopt(multiHandle, CURLMOPT_PIPELINING, CURLPIPE_HTTP1 | CURLPIPE_MULTIPLEX));
-	mc(curl_multi_setopt(multiHandle, CURLMOPT_MAX_TOTAL_CONNECTIONS, 8));
-	mc(curl_multi_setopt(multiHandle, CURLMOPT_MAX_HOST_CONNECTIONS, 1));
-	mc(curl_multi_setopt(multiHandle, CURLMOPT_MAXCONNECTS, 8));
+	// cancellations and completions are deferred to here, so curl never gets called back
+	// into from its own callbacks, and finished transfers are read once per loop iteration
+	deferredCaller = loop.async([this] (nev::Async&) {
+		completionScheduled = false;
+		processCancelled();
+		processCompleted();
+	}, true);
+
+	applyTuning();
 
 	mc(curl_multi_setopt(multiHandle, CURLMOPT_TIMERDATA, this));
 	mc(curl_multi_setopt(multiHandle, CURLMOPT_TIMERFUNCTION, +[] (CURLM * multi, long tmo_ms, void * u) -> int {
@@ -269,34 +486,9 @@ AsyncCurl::AsyncCurl(Loop& loop)
 	}));
 
 	mc(curl_multi_setopt(multiHandle, CURLMOPT_SOCKETDATA, this));
-	mc(curl_multi_setopt(multiHandle, CURLMOPT_SOCKETFUNCTION, +[] (CURL * e, curl_socket_t s, int what, void * up, void * sp) -> int {
-		struct Priv { // lazy solution
-			std::unique_ptr<Poll> poll;
-		};
-
-		// listen for event what on socket s of easy handle e, s priv data on sp
-		AsyncCurl * ah = static_cast<AsyncCurl *>(up);
-		Priv * priv = static_cast<Priv *>(sp);
-
-		if (what == CURL_POLL_REMOVE) {
-			delete priv;
-			mc(curl_multi_assign(ah->multiHandle, s, nullptr));
-			return 0;
-		}
-
-		if (!priv) {
-			priv = new Priv{ah->loop.poll(static_cast<int>(s))};
-			mc(curl_multi_assign(ah->multiHandle, s, priv));
-
-			priv->poll->start(curlEvToNev(what), [ah, s] (Poll&, int status, int events) {
-				mc(curl_multi_socket_action(ah->multiHandle, s, nevToCurl(events), &ah->handleCount));
-				ah->processCompleted();
-			});
-
-		} else {
-			priv->poll->change(curlEvToNev(what));
-		}
-
+	mc(curl_multi_setopt(multiHandle, CURLMOPT_SOCKETFUNCTION, +[] (CURL * /*e*/, curl_socket_t s, int what, void * up, void * /*sp*/) -> int {
+		// listen for event what on socket s, polls are kept in our table instead of curl's socket pointers
+		static_cast<AsyncCurl *>(up)->updateSocket(static_cast<int>(s), what);
 		return 0;
 	}));
 }
@@ -304,8 +496,12 @@ AsyncCurl::AsyncCurl(Loop& loop)
 AsyncCurl::~AsyncCurl() {
 	stopTimer();
 
-	for (CurlHandle * ch : pendingRequests) {
-		delete ch;
+	for (auto& req : pendingRequests) {
+		delete req.second;
+	}
+
+	for (void * e : idleHandles) {
+		curl_easy_cleanup(e);
 	}
 
 	mc(curl_multi_cleanup(multiHandle));
@@ -319,10 +515,35 @@ int AsyncCurl::queuedRequests() const {
 	return pendingRequests.size();
 }
 
+void AsyncCurl::setTuning(Tuning t) {
+	tuning = std::move(t);
+	applyTuning();
+
+	while (idleHandles.size() > tuning.maxIdleHandles) {
+		curl_easy_cleanup(idleHandles.back());
+		idleHandles.pop_back();
+	}
+}
+
+const AsyncCurl::Tuning& AsyncCurl::getTuning() const {
+	return tuning;
+}
+
+const std::unordered_map<std::string, AsyncCurl::HostStats>& AsyncCurl::hostStats() const {
+	return hosts;
+}
+
+AsyncCurl::HandlePoolStats AsyncCurl::handlePoolStats() const {
+	HandlePoolStats ps = poolStats;
+	ps.idle = idleHandles.size();
+	return ps;
+}
+
 void AsyncCurl::smtpSendMail(const std::string& url, const std::string& from, const std::string& to,
 		const std::string& subject, const std::string& message, std::function<void(AsyncCurl::Result)> onFinished) {
-	pendingRequests.emplace(new CurlSmtpHandle(multiHandle, url,
-		from, to, subject, message, smtpSenderName, std::move(onFinished)));
+	HostStats& hs = statsFor(url);
+	track(new CurlSmtpHandle(*this, url,
+		from, to, subject, message, smtpSenderName, std::move(onFinished)), hs, {});
 	//update();
 }
 
@@ -349,12 +570,35 @@ void AsyncCurl::smtpSetSenderName(std::string newName) {
 
 void AsyncCurl::httpGet(std::string url, std::unordered_map<std::string_view, std::string_view> params,
 		std::function<void(AsyncCurl::Result)> onFinished) {
-	pendingRequests.emplace(new CurlHttpHandle(multiHandle, std::move(url), std::move(params), std::move(onFinished)));
-	//update();
+	Request req(std::move(url));
+	req.addParams(params);
+	request(std::move(req), std::move(onFinished));
 }
 
 void AsyncCurl::httpGet(std::string url, std::function<void(AsyncCurl::Result)> onFinished) {
-	httpGet(std::move(url), {}, std::move(onFinished));
+	request(Request(std::move(url)), std::move(onFinished));
+}
+
+AsyncCurl::Handle AsyncCurl::request(Request req, std::function<void(AsyncCurl::Result)> onFinished) {
+	return request(std::move(req), std::stop_token{}, std::move(onFinished));
+}
+
+AsyncCurl::Handle AsyncCurl::request(Request req, std::stop_token st, std::function<void(AsyncCurl::Result)> onFinished) {
+	HostStats& hs = statsFor(req.url);
+	return track(new CurlHttpHandle(*this, std::move(req), std::move(onFinished)), hs, std::move(st));
+}
+
+AsyncCurl::RequestAwaiter AsyncCurl::request(Request req, std::stop_token st) {
+	return {*this, std::move(req), std::move(st)};
+}
+
+void AsyncCurl::cancelRequest(u64 id) {
+	{
+		std::lock_guard<std::mutex> lk(cancelMut);
+		cancelledRequests.emplace_back(id);
+	}
+
+	deferredCaller->send();
 }
 
 // lots of allocs can happen here, bad!
@@ -372,9 +616,136 @@ std::string AsyncCurl::urlEscape(std::string_view str) {
 }
 
 
+void * AsyncCurl::acquireEasyHandle() {
+	if (!idleHandles.empty()) {
+		void * e = idleHandles.back();
+		idleHandles.pop_back();
+		poolStats.hits++;
+		return e;
+	}
+
+	poolStats.misses++;
+	return curl_easy_init();
+}
+
+void AsyncCurl::releaseEasyHandle(void * e) {
+	if (idleHandles.size() >= tuning.maxIdleHandles) {
+		curl_easy_cleanup(e);
+		return;
+	}
+
+	// keeps the session id and dns caches, drops all options
+	curl_easy_reset(e);
+	idleHandles.emplace_back(e);
+}
+
+void AsyncCurl::applyTuning() {
+	mc(curl_multi_setopt(multiHandle, CURLMOPT_PIPELINING, CURLPIPE_HTTP1 | (tuning.multiplex ? CURLPIPE_MULTIPLEX : 0)));
+	mc(curl_multi_setopt(multiHandle, CURLMOPT_MAX_TOTAL_CONNECTIONS, tuning.maxTotalConnections));
+	mc(curl_multi_setopt(multiHandle, CURLMOPT_MAX_HOST_CONNECTIONS, tuning.maxHostConnections));
+	mc(curl_multi_setopt(multiHandle, CURLMOPT_MAXCONNECTS, tuning.maxConnects));
+#if LIBCURL_VERSION_NUM >= 0x074300 // 7.67.0
+	mc(curl_multi_setopt(multiHandle, CURLMOPT_MAX_CONCURRENT_STREAMS, tuning.maxConcurrentStreams));
+#endif
+}
+
+AsyncCurl::HostStats& AsyncCurl::statsFor(std::string_view url) {
+	// connections are shared per scheme, host and port, drop the userinfo and path
+	sz_t hostStart = url.find("://");
+	hostStart = hostStart == std::string_view::npos ? 0 : hostStart + 3;
+	sz_t hostEnd = std::min(url.find_first_of("/?#", hostStart), url.size());
+	sz_t at = url.find('@', hostStart);
+	std::string key(url.substr(0, hostStart));
+	key += url.substr(at < hostEnd ? at + 1 : hostStart, hostEnd - (at < hostEnd ? at + 1 : hostStart));
+
+	return hosts[std::move(key)];
+}
+
+AsyncCurl::Handle AsyncCurl::track(CurlHandle * ch, HostStats& hs, std::stop_token st) {
+	u64 id = nextRequestId++;
+	ch->id = id;
+	ch->host = &hs;
+	pendingRequests.emplace(id, ch);
+	hs.peakActive = std::max(hs.peakActive, ++hs.active);
+
+	if (st.stop_possible()) {
+		// may be called from other threads, the callback's destructor waits for it to finish
+		ch->stopCb.emplace(std::move(st), [this, id] { cancelRequest(id); });
+	}
+
+	return {*this, id};
+}
+
+void AsyncCurl::processCancelled() {
+	std::vector<u64> ids;
+	{
+		std::lock_guard<std::mutex> lk(cancelMut);
+		ids.swap(cancelledRequests);
+	}
+
+	for (u64 id : ids) {
+		auto search = pendingRequests.find(id);
+		if (search == pendingRequests.end()) {
+			continue; // already finished
+		}
+
+		CurlHandle * hdl = search->second;
+		pendingRequests.erase(search);
+		hdl->host->active--;
+		hdl->host->failed++;
+
+		std::unique_ptr<CurlHandle> owned(hdl); // removes the easy handle from curl even if the callback throws
+		hdl->cancelled();
+	}
+}
+
+void AsyncCurl::updateSocket(int fd, int what) {
+	if (what == CURL_POLL_REMOVE) {
+		// the poll can't be destroyed here, this may run from inside its own callback
+		if (static_cast<sz_t>(fd) < sockets.size() && sockets[fd].active) {
+			sockets[fd].poll->stop();
+			sockets[fd].active = false;
+		}
+
+		return;
+	}
+
+	if (static_cast<sz_t>(fd) >= sockets.size()) {
+		sockets.resize(fd + 1);
+	}
+
+	SocketSlot& slot = sockets[fd];
+	if (slot.active) {
+		slot.poll->change(curlEvToNev(what));
+		return;
+	}
+
+	if (!slot.poll) {
+		slot.poll = loop.poll(fd);
+	}
+
+	slot.poll->start(curlEvToNev(what), [this, fd] (Poll&, int, int events) {
+		onSocketEvent(fd, events);
+	});
+
+	slot.active = true;
+}
+
+void AsyncCurl::onSocketEvent(int fd, int events) {
+	mc(curl_multi_socket_action(multiHandle, fd, nevToCurl(events), &handleCount));
+	scheduleCompletion();
+}
+
+void AsyncCurl::scheduleCompletion() {
+	if (!completionScheduled) {
+		completionScheduled = true;
+		deferredCaller->send();
+	}
+}
+
 void AsyncCurl::update() {
 	mc(curl_multi_socket_action(multiHandle, CURL_SOCKET_TIMEOUT, 0, &handleCount));
-	processCompleted();
+	scheduleCompletion();
 }
 
 void AsyncCurl::processCompleted() {
@@ -385,10 +756,16 @@ void AsyncCurl::processCompleted() {
 		if (m->msg == CURLMSG_DONE) {
 			ec(curl_easy_getinfo(m->easy_handle, CURLINFO_PRIVATE, &hdl));
 
-			auto search = pendingRequests.find(hdl);
+			pendingRequests.erase(hdl->id);
 
-			if (search != pendingRequests.end()) {
-				pendingRequests.erase(search);
+			if (HostStats * hs = hdl->host) {
+				long connects = 0;
+				ec(curl_easy_getinfo(m->easy_handle, CURLINFO_NUM_CONNECTS, &connects));
+				hs->active--;
+				hs->completed++;
+				hs->failed += m->data.result != CURLE_OK;
+				hs->newConnections += connects;
+				hs->reusedConnections += connects == 0 && m->data.result == CURLE_OK;
 			}
 
 			hdl->finished(m->data.result);
@@ -396,9 +773,8 @@ void AsyncCurl::processCompleted() {
 		}
 	}
 
-	if (handleCount == 0) {
-		stopTimer();
-	}
+	// no need to stop the timer when idle, curl asks for it with a -1 timeout. handleCount
+	// can be stale here, requests added by the callbacks above aren't counted yet
 }
 
 void AsyncCurl::startTimer(long timeout) {
@@ -1,36 +1,101 @@
 #pragma once
 
+#include <chrono>
+#include <coroutine>
 #include <functional>
+#include <mutex>
+#include <optional>
+#include <stop_token>
 #include <string>
 #include <string_view>
-#include <unordered_set>
 #include <unordered_map>
+#include <vector>
 
 #include "Poll.hpp"
+#include "explints.hpp"
 
 class CurlHandle;
+class CurlHttpHandle;
 
 class AsyncCurl {
 public:
 	class Result;
+	class Request;
+	class RequestAwaiter;
+	class Handle;
+
+	struct Tuning {
+		long maxTotalConnections = 8; // 0 means no limit
+		long maxHostConnections = 1; // requests past this wait for a free connection
+		long maxConnects = 8; // size of the idle connection cache
+		bool multiplex = true; // HTTP/2 streams over one connection
+		long maxConcurrentStreams = 100; // per multiplexed connection
+		std::chrono::seconds maxConnectionAge{118}; // idle connections older than this aren't reused
+		std::chrono::seconds dnsCacheTimeout{60}; // -1 caches forever
+		bool tcpKeepAlive = true;
+		std::chrono::seconds keepAliveIdle{60};
+		std::chrono::seconds keepAliveInterval{30};
+		// defaults for requests that don't set their own, 0 means none
+		std::chrono::milliseconds timeout{0};
+		std::chrono::milliseconds connectTimeout{10000};
+		sz_t maxIdleHandles = 16; // reset easy handles kept for reuse
+	};
+
+	struct HostStats {
+		u32 active = 0; // in flight, or waiting for a connection
+		u32 peakActive = 0;
+		u64 completed = 0;
+		u64 failed = 0;
+		u64 newConnections = 0;
+		u64 reusedConnections = 0; // requests that didn't need to connect
+	};
+
+	struct HandlePoolStats {
+		u64 hits = 0;
+		u64 misses = 0;
+		sz_t idle = 0;
+	};
 
 private:
+	struct SocketSlot {
+		std::unique_ptr<nev::Poll> poll;
+		bool active = false;
+	};
+
 	std::string localSmtpUrl;
 	std::string smtpSenderName;
 	nev::Loop& loop;
 	std::unique_ptr<nev::Timer> timer;
 	void * multiHandle;
 	int handleCount;
-	std::unordered_set<CurlHandle *> pendingRequests;
+	std::unordered_map<u64, CurlHandle *> pendingRequests;
+	u64 nextRequestId;
 	bool isTimerRunning;
+	bool completionScheduled;
+	std::vector<SocketSlot> sockets; // indexed by fd, polls are only stopped on removal and reused
+	std::unique_ptr<nev::Async> deferredCaller;
+	std::mutex cancelMut;
+	std::vector<u64> cancelledRequests;
+	std::vector<void *> idleHandles;
+	HandlePoolStats poolStats;
+	Tuning tuning;
+	std::unordered_map<std::string, HostStats> hosts;
 
 public:
 	AsyncCurl(nev::Loop&);
+	AsyncCurl(nev::Loop&, Tuning);
 	~AsyncCurl();
 
 	int activeHandles() const;
 	int queuedRequests() const;
 
+	// connection limits apply immediately, per request options only to new requests
+	void setTuning(Tuning);
+	const Tuning& getTuning() const;
+	// keyed by scheme://host[:port], entries are kept for the lifetime of this object
+	const std::unordered_map<std::string, HostStats>& hostStats() const;
+	HandlePoolStats handlePoolStats() const;
+
 	void smtpSendMail(const std::string& url, const std::string& from, const std::string& to, const std::string& subject, const std::string& message, std::function<void(AsyncCurl::Result)>);
 	void smtpSendMail(const std::string& url, const std::string& to, const std::string& subject, const std::string& message, std::function<void(AsyncCurl::Result)>);
 	void smtpRelay(const std::string& to, const std::string& subject, const std::string& message, std::function<void(AsyncCurl::Result)>);
@@ -39,15 +104,30 @@ public:
 
 	void httpGet(std::string url, std::unordered_map<std::string_view, std::string_view> params, std::function<void(AsyncCurl::Result)>);
 	void httpGet(std::string url, std::function<void(AsyncCurl::Result)>);
-	/* No cancelRequest(), see: https://github.com/curl/curl/issues/2101 */
+	Handle request(Request, std::function<void(AsyncCurl::Result)>);
+	Handle request(Request, std::stop_token, std::function<void(AsyncCurl::Result)>);
+	RequestAwaiter request(Request, std::stop_token = {}); // for coroutines, resolves to the Result
+	// cancels by handle id, safe from any callback or thread
+	void cancelRequest(u64 id);
 
 	static std::string urlEscape(std::string_view);
 
 private:
+	void * acquireEasyHandle();
+	void releaseEasyHandle(void *);
+	void applyTuning();
+	HostStats& statsFor(std::string_view url);
+	Handle track(CurlHandle *, HostStats&, std::stop_token);
+	void processCancelled();
+	void updateSocket(int fd, int what);
+	void onSocketEvent(int fd, int events);
+	void scheduleCompletion();
 	void update();
 	void processCompleted();
 	void startTimer(long);
 	void stopTimer();
+
+	friend CurlHandle;
 };
 
 class AsyncCurl::Result {
@@ -59,3 +139,66 @@ public:
 
 	Result(long, std::string, const char *);
 };
+
+// HTTP request builder, GET by default, or POST once a body is set
+class AsyncCurl::Request {
+	std::string url;
+	std::string method;
+	std::string body;
+	std::vector<std::string> headers;
+	std::function<bool(std::string_view)> dataCb;
+	std::chrono::milliseconds timeout;
+	std::chrono::milliseconds connectTimeout;
+	std::chrono::steady_clock::time_point deadline;
+	bool hasParams;
+	bool hasBody; // even if empty, it's still a POST
+
+public:
+	Request(std::string url);
+
+	Request& setMethod(std::string); // e.g. PUT, DELETE, PATCH
+	Request& addParams(const std::unordered_map<std::string_view, std::string_view>&); // to the url's query string
+	Request& addHeader(std::string_view name, std::string_view value);
+	Request& setBody(std::string, std::string_view contentType = {});
+	Request& setFormBody(const std::unordered_map<std::string_view, std::string_view>&); // urlencoded
+	Request& setTimeout(std::chrono::milliseconds); // for the whole request, 0 means none
+	Request& setConnectTimeout(std::chrono::milliseconds);
+	Request& setDeadline(std::chrono::steady_clock::time_point); // the timeout is computed when sent
+	// the response body is passed in chunks as it arrives instead of being stored in Result::data.
+	// return false to abort the request
+	Request& onData(std::function<bool(std::string_view)>);
+
+	friend AsyncCurl;
+	friend CurlHttpHandle;
+};
+
+// refers to a sent request, can outlive it.
+// a cancelled request finishes unsuccessfully on the next loop iteration
+class AsyncCurl::Handle {
+	AsyncCurl * ac;
+	u64 id;
+
+public:
+	Handle();
+	Handle(AsyncCurl&, u64 id);
+
+	void cancel() const;
+	bool isPending() const;
+	u64 getId() const;
+
+	explicit operator bool() const;
+};
+
+class AsyncCurl::RequestAwaiter {
+	AsyncCurl& ac;
+	std::optional<Request> req;
+	std::optional<Result> res;
+	std::stop_token st;
+
+public:
+	RequestAwaiter(AsyncCurl&, Request, std::stop_token = {});
+
+	bool await_ready() const noexcept;
+	void await_suspend(std::coroutine_handle<> h);
+	Result await_resume();
+};
@@ -2,10 +2,16 @@
 #include "OpCancelledException.hpp"
 #include "Poll.hpp"
 
+#include <algorithm>
 #include <iostream>
+#include <limits>
 #include <stdexcept>
 #include <utility>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 
 #include <explints.hpp>
 #include <TimedCallbacks.hpp>
@@ -15,10 +21,6 @@
 using namespace nev;
 using namespace std::chrono_literals;
 
-bool AsyncPostgres::QuerySharedPtrComparator::operator()(const ll::shared_ptr<Query>& lhs, const ll::shared_ptr<Query>& rhs) const {
-	return *lhs > *rhs;
-}
-
 static void getStringPointers(const std::unordered_map<std::string, std::string>& str, const char ** k, const char ** v) {
 	sz_t i = 0;
 	for (auto it = str.begin(); it != str.end(); ++it) {
@@ -31,6 +33,97 @@ static void getStringPointers(const std::unordered_map<std::string, std::string>
 	k[i] = v[i] = nullptr;
 }
 
+// utility commands can't be prepared, e.g. LISTEN or BEGIN
+static bool isPreparable(std::string_view cmd) {
+	sz_t start = cmd.find_first_not_of(" \t\r\n(");
+	if (start == std::string_view::npos) {
+		return false;
+	}
+
+	cmd.remove_prefix(start);
+	std::string_view word = cmd.substr(0, cmd.find_first_of(" \t\r\n("));
+	for (std::string_view kw : {"select", "insert", "update", "delete", "values", "with", "merge", "table"}) {
+		if (word.size() == kw.size() && std::equal(word.begin(), word.end(), kw.begin(), [] (char a, char b) {
+			return (a | 0x20) == b;
+		})) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// PQcancel() connects to the server and waits for it to process the request, so it's called from here.
+// one thread for the whole process, cancels of a stalled server don't spawn one each
+class AsyncPostgres::CancelWorker {
+	struct Request {
+		PGcancel * cancel;
+		std::shared_ptr<std::atomic<bool>> pending;
+	};
+
+	std::mutex mut;
+	std::condition_variable cv;
+	std::deque<Request> requests;
+	bool stopping;
+	std::thread thread;
+
+	CancelWorker()
+	: stopping(false),
+	  thread([this] { run(); }) { }
+
+public:
+	~CancelWorker() {
+		{
+			std::lock_guard lock(mut);
+			stopping = true;
+		}
+
+		cv.notify_one();
+		thread.join(); // waits for the cancel in progress, if any
+		for (auto& r : requests) {
+			PQfreeCancel(r.cancel);
+		}
+	}
+
+	static CancelWorker& get() {
+		static CancelWorker w; // joined on exit instead of leaving a thread running
+		return w;
+	}
+
+	void push(PGcancel * c, std::shared_ptr<std::atomic<bool>> pending) {
+		{
+			std::lock_guard lock(mut);
+			requests.push_back({c, std::move(pending)});
+		}
+
+		cv.notify_one();
+	}
+
+private:
+	void run() {
+		std::unique_lock lock(mut);
+		while (true) {
+			cv.wait(lock, [this] { return stopping || !requests.empty(); });
+			if (stopping) {
+				return;
+			}
+
+			Request r = std::move(requests.front());
+			requests.pop_front();
+			lock.unlock();
+
+			char err[256];
+			if (!PQcancel(r.cancel, err, sizeof(err))) {
+				std::cerr << "[Postgre/requestServerCancel()]: " << err << std::endl;
+			}
+
+			PQfreeCancel(r.cancel);
+			r.pending->store(false, std::memory_order_release);
+			lock.lock();
+		}
+	}
+};
+
 static int postgresEvToUv(int ev) {
 	using Evt = nev::Poll::Evt;
 	switch (ev) { // the pg enum is not composed of powers of two
@@ -51,13 +144,31 @@ AsyncPostgres::AsyncPostgres(Loop& loop, TimedCallbacks& tc)
   nextCommandCaller(),
   pgConn(nullptr, PQfinish),
   pSock(),
-  queries(QuerySharedPtrComparator()),
-  currentQuery(queries.end()),
+  queries(),
+  inFlight(),
+  copyWaiter(nullptr),
+  failedCopyWaiter(nullptr),
+  cancelPending(std::make_shared<std::atomic<bool>>(false)),
+  preparedStatements(),
+  preparedCache(),
+  preparedCacheSize(0),
+  preparedNameCounter(0),
+  preparedHits(0),
+  preparedMisses(0),
+  preparedEvictions(0),
+  binaryResults(false),
+  copying(false),
+  statsEnabled(false),
+  queryStats(),
+  channelList(),
+  channels(),
   notifFunc(nullptr),
   connChangeFunc(nullptr),
+  pipelineDepth(1),
+  pipelineSyncsPending(0),
   stopOnceEmpty(false),
   busy(false),
-  awaitingResponse(false),
+  readPaused(false),
   autoReconnect(true),
   debugPrinting(false) {
 
@@ -66,6 +177,20 @@ AsyncPostgres::AsyncPostgres(Loop& loop, TimedCallbacks& tc)
 	}, true);
 }
 
+AsyncPostgres::~AsyncPostgres() {
+	// a suspended copy can't be resumed anymore, but its destructor mustn't touch us
+	for (CopyAwaiter * cw : {copyWaiter, failedCopyWaiter}) {
+		if (cw) {
+			cw->ap = nullptr;
+		}
+	}
+
+	// queries can outlive us if someone else holds them, don't leave them pointing here
+	while (!deadlines.empty()) {
+		clearDeadline(*deadlines.begin()->second);
+	}
+}
+
 void AsyncPostgres::connect(std::unordered_map<std::string, std::string> connParams, bool expandDbname) {
 	std::vector<const char*> keywords(connParams.size() + 1); // +1 for null termination
 	std::vector<const char*> values(connParams.size() + 1);
@@ -85,6 +210,7 @@ void AsyncPostgres::connect(std::unordered_map<std::string, std::string> connPar
 }
 
 bool AsyncPostgres::reconnect() {
+	requeueInFlight();
 	if (pgConn && PQresetStart(pgConn.get())) {
 		pollConnection<PQresetPoll>();
 		return true;
@@ -103,6 +229,9 @@ void AsyncPostgres::lazyDisconnect() {
 void AsyncPostgres::disconnect() {
 	bool notify = isConnected();
 
+	endCopy();
+	requeueInFlight();
+	clearPreparedStatements();
 	pSock = nullptr;
 	pgConn = nullptr;
 	busy = false;
@@ -121,19 +250,53 @@ void AsyncPostgres::setDebugPrinting(bool state) {
 	debugPrinting = state;
 }
 
+void AsyncPostgres::setBinaryResults(bool state) {
+	binaryResults = state;
+}
+
+void AsyncPostgres::setPipelineDepth(sz_t depth) {
+	// pipeline mode is entered/exited once the connection is idle
+	pipelineDepth = std::max<sz_t>(depth, 1);
+	if (isConnected()) {
+		signalCompletion();
+	}
+}
+
+void AsyncPostgres::setPreparedStatementCacheSize(sz_t size) {
+	preparedCacheSize = size;
+	evictPreparedStatements(size);
+}
+
+void AsyncPostgres::setStatsEnabled(bool state) {
+	statsEnabled = state;
+}
+
+void AsyncPostgres::resetStats() {
+	queryStats = {};
+}
+
 bool AsyncPostgres::cancelQuery(Query& q) {
 	if (q.isDone()) {
 		return false;
 	}
 
-	auto it = q.getQueueIterator();
-	if (it == currentQuery && awaitingResponse) {
-		// query is already sent (or being sent) to postgres, cancel request might fail
-		return PQrequestCancel(pgConn.get()) == 1;
-		// return false;
+	if (q.sent) {
+		// query is already sent to postgres, cancel request might fail. with pipelining,
+		// only the query the server is currently running can be cancelled without affecting others
+		if (inFlight.empty() || inFlight.front().get() != &q) {
+			return false;
+		}
+
+		return requestServerCancel();
 	}
 
-	queries.erase(it);
+	// may be the last reference, q must stay alive until its deadline is cleared
+	auto qp = queries.erase(q);
+	if (!qp) {
+		return false;
+	}
+
+	clearDeadline(q);
 	return true;
 }
 
@@ -145,10 +308,73 @@ ConnStatusType AsyncPostgres::getStatus() const {
 	return pgConn ? PQstatus(pgConn.get()) : CONNECTION_BAD;
 }
 
+sz_t AsyncPostgres::moveQueuedQueriesTo(AsyncPostgres& to) {
+	if (&to == this) {
+		return 0;
+	}
+
+	std::vector<ll::shared_ptr<Query>> kept;
+	sz_t moved = 0;
+	while (!queries.empty()) {
+		auto q = queries.pop();
+		if (q->pinned) {
+			kept.emplace_back(std::move(q));
+			continue;
+		}
+
+		auto deadline = q->deadline;
+		clearDeadline(*q);
+		q->ap = &to;
+		q->deadlineIt = to.deadlines.end(); // end() of the old map isn't valid there
+		if (deadline != std::chrono::steady_clock::time_point{}) {
+			to.setDeadline(*q, deadline);
+		}
+
+		to.queries.push(std::move(q));
+		++moved;
+	}
+
+	// popped in order, so pushing them back keeps it
+	for (auto& q : kept) {
+		queries.push(std::move(q));
+	}
+
+	if (moved > 0 && to.isConnected() && to.inFlight.size() < to.maxInFlight()) {
+		to.signalCompletion();
+	}
+
+	return moved;
+}
+
 sz_t AsyncPostgres::queuedQueries() const {
 	return queries.size();
 }
 
+sz_t AsyncPostgres::inFlightQueries() const {
+	return inFlight.size();
+}
+
+AsyncPostgres::PreparedStatementStats AsyncPostgres::preparedStatementStats() const {
+	return {preparedHits, preparedMisses, preparedEvictions, preparedCache.size()};
+}
+
+const AsyncPostgres::Stats& AsyncPostgres::stats() const {
+	return queryStats;
+}
+
+sz_t AsyncPostgres::queriesAhead(int priority) const {
+	// new queries go after the ones with the same priority
+	return inFlight.size() + queries.countAhead(priority);
+}
+
+sz_t AsyncPostgres::getPipelineDepth() const {
+	return pipelineDepth;
+}
+
+bool AsyncPostgres::isPipelining() const {
+	return pgConn && PQpipelineStatus(pgConn.get()) != PQ_PIPELINE_OFF;
+}
+
 bool AsyncPostgres::isAutoReconnectEnabled() const {
 	return autoReconnect;
 }
@@ -165,11 +391,27 @@ void AsyncPostgres::onNotification(std::function<void(Notification)> f) {
 	notifFunc = std::move(f);
 }
 
+AsyncPostgres::Subscription AsyncPostgres::subscribe(std::string channel, std::function<void(const Notification&)> f) {
+	auto search = channels.find(channel);
+	if (search == channels.end()) {
+		listen(channel, true);
+		channelList.push_front({std::move(channel), {}, false});
+		search = channels.emplace(channelList.front().name, channelList.begin()).first;
+	}
+
+	auto ch = search->second;
+	ch->handlers.emplace_back(std::move(f));
+	return {this, ch, std::prev(ch->handlers.end())};
+}
+
 void AsyncPostgres::maybeSignalDisconnectionAndReconnect() {
 	if (isConnected()) {
 		return;
 	}
 
+	// results for these will never arrive, send them again once reconnected
+	endCopy();
+	requeueInFlight();
 	pSock = nullptr;
 	if (connChangeFunc) {
 		connChangeFunc(getStatus());
@@ -206,6 +448,10 @@ void AsyncPostgres::pollConnection() {
 				break;
 
 			case PGRES_POLLING_OK:
+				clearPreparedStatements(); // new session
+				for (const auto& ch : channelList) {
+					listen(ch.name, true);
+				}
 				p.start(Poll::Evt::READABLE | Poll::Evt::WRITABLE, [this] (Poll& p, int s, int e) {
 					socketCallback(p, s, e);
 				});
@@ -230,7 +476,11 @@ void AsyncPostgres::signalCompletion() {
 }
 
 void AsyncPostgres::processNextCommand() {
-	busy = !queries.empty();
+	if (failedCopyWaiter) {
+		std::exchange(failedCopyWaiter, nullptr)->fail();
+	}
+
+	busy = !queries.empty() || !inFlight.empty();
 	if (!busy) {
 		if (stopOnceEmpty) {
 			disconnect();
@@ -239,85 +489,565 @@ void AsyncPostgres::processNextCommand() {
 		return;
 	}
 
-	currentQuery = queries.begin();
-	if (debugPrinting) {
-		(*currentQuery)->print();
+	if (!pgConn) {
+		return;
+	}
+
+	if (readPaused && pSock && !resultsBacklogged()) {
+		manageSocketEvents(false); // results already buffered won't make the socket readable again
+	}
+
+	if (inFlight.empty()) {
+		updatePipelineMode();
+	}
+
+	bool failed = false;
+	while (!failed && !queries.empty() && inFlight.size() < maxInFlight() && !awaitingExecute()) {
+		Query& q = queries.front();
+		if (q.deadlineIt != deadlines.end() && q.deadline <= std::chrono::steady_clock::now()) {
+			expire(queries.pop());
+			continue;
+		}
+
+		if (debugPrinting) {
+			q.print();
+		}
+
+		if (!sendQuery(q)) {
+			failed = true;
+			break;
+		}
+
+		// not pop(), sending may have queued something ahead of q (statement evictions)
+		failed = !addInFlight(queries.erase(q));
+	}
+
+	if (failed) {
+		// if query sending failed
+		printLastError();
+		if (!isConnected()) {
+			maybeSignalDisconnectionAndReconnect();
+			return;
+		}
+
+		// this should never happen, but just in case try again in 5 secs
+		qRetryTimer = tc.timer([this] {
+			processNextCommand();
+			return false;
+		}, 5000ms);
 	}
 
-	if ((*currentQuery)->send(pgConn.get())) {
-		awaitingResponse = true;
+	if (pSock) { // the query may not fit in the socket buffer
+		updateSocketEvents(PQflush(pgConn.get()));
+	}
+}
+
+sz_t AsyncPostgres::maxInFlight() const {
+	return isPipelining() ? pipelineDepth : 1;
+}
+
+bool AsyncPostgres::awaitingExecute() const {
+	// a query sent behind it would run first, since the execute is only sent after the prepare completes
+	return !inFlight.empty() && inFlight.back()->preparing && !inFlight.back()->executePipelined;
+}
+
+void AsyncPostgres::updatePipelineMode() {
+	bool wanted = pipelineDepth > 1;
+	if (wanted == isPipelining() || pipelineSyncsPending > 0) {
 		return;
 	}
 
-	// if query sending failed
-	currentQuery = queries.end();
-	printLastError();
-	if (!isConnected()) {
-		maybeSignalDisconnectionAndReconnect();
+	if (!(wanted ? PQenterPipelineMode(pgConn.get()) : PQexitPipelineMode(pgConn.get()))) {
+		printLastError();
+	}
+}
+
+bool AsyncPostgres::sendPipelineSync() {
+#ifdef LIBPQ_HAS_SEND_PIPELINE_SYNC
+	bool ok = PQsendPipelineSync(pgConn.get()) == 1; // doesn't flush, done once after the whole batch
+#else
+	bool ok = PQpipelineSync(pgConn.get()) == 1;
+#endif
+
+	pipelineSyncsPending += ok;
+	return ok;
+}
+
+int AsyncPostgres::sendQuery(Query& q) {
+	PGconn * conn = pgConn.get();
+	if (statsEnabled) {
+		q.sentAt = std::chrono::steady_clock::now();
+	}
+
+	if (preparedCacheSize == 0 || !q.cacheable || !isPreparable(q.command)) {
+		return q.send(conn);
+	}
+
+	auto search = preparedCache.find(q.command);
+	if (search != preparedCache.end()) {
+		auto entry = search->second;
+		preparedStatements.splice(preparedStatements.begin(), preparedStatements, entry);
+		if (entry->second.ready) {
+			++preparedHits;
+			return q.sendPrepared(conn, entry->second.name.c_str());
+		}
+
+		// still being prepared by another query, don't wait for it
+		++preparedMisses;
+		return q.send(conn);
+	}
+
+	++preparedMisses;
+	evictPreparedStatements(preparedCacheSize - 1);
+
+	auto& entry = preparedStatements.emplace_front(q.command, PreparedStatement{"naga_ps" + std::to_string(++preparedNameCounter), false});
+	if (!q.sendPrepare(conn, entry.second.name.c_str())) {
+		preparedStatements.pop_front();
+		return 0;
+	}
+
+	preparedCache.emplace(entry.first, preparedStatements.begin());
+	q.preparing = true;
+	// with pipelining the execute can go right behind the prepare, keeping the query's place in the pipeline.
+	// if the prepare fails the execute is aborted by the server, the query gets the prepare's error
+	q.executePipelined = isPipelining() && q.sendPrepared(conn, entry.second.name.c_str());
+	return 1;
+}
+
+bool AsyncPostgres::addInFlight(ll::shared_ptr<Query> q) {
+	q->sent = true;
+	inFlight.emplace_back(std::move(q));
+	if (inFlight.size() == 1) {
+		setRowMode(); // must be done right after sending
+	}
+
+	// a sync after every query gives each one its own implicit transaction, like in non-pipelined mode
+	return !isPipelining() || sendPipelineSync();
+}
+
+void AsyncPostgres::sendPreparedQuery(ll::shared_ptr<Query> q) {
+	q->preparing = false;
+
+	auto search = preparedCache.find(q->command);
+	if (search == preparedCache.end()) {
+		requeue(std::move(q));
+		signalCompletion();
 		return;
 	}
 
-	// this should never happen, but just in case try again in 5 secs
-	qRetryTimer = tc.timer([this] {
-		processNextCommand();
-		return false;
-	}, 5000ms);
+	if (!q->sendPrepared(pgConn.get(), search->second->second.name.c_str())) {
+		printLastError();
+		requeue(std::move(q));
+		signalCompletion();
+		return;
+	}
+
+	if (!addInFlight(std::move(q))) {
+		printLastError();
+	}
+
+	// sent from the result handler, nothing else would flush it
+	if (pSock) {
+		updateSocketEvents(PQflush(pgConn.get()));
+	}
+}
+
+void AsyncPostgres::setRowMode() {
+	// libpq only allows this before the first result of the query it's currently processing is read
+	Query& q = *inFlight.front();
+	if (q.chunkRows == 0 || q.rowModeSet || q.preparing) {
+		return;
+	}
+
+#ifdef LIBPQ_HAS_CHUNK_MODE
+	q.rowModeSet = q.chunkRows > 1
+		? PQsetChunkedRowsMode(pgConn.get(), q.chunkRows)
+		: PQsetSingleRowMode(pgConn.get());
+#else
+	q.rowModeSet = PQsetSingleRowMode(pgConn.get());
+#endif
+}
+
+void AsyncPostgres::requeue(ll::shared_ptr<Query> q) {
+	q->sent = false;
+	q->preparing = false;
+	q->executePipelined = false;
+	q->rowModeSet = false;
+	// put it in front of the queries with the same priority
+	queries.pushFront(std::move(q));
+}
+
+void AsyncPostgres::requeueInFlight() {
+	pipelineSyncsPending = 0;
+	readPaused = false;
+	// in reverse, so they keep the same order
+	for (auto it = inFlight.rbegin(); it != inFlight.rend(); ++it) {
+		if (!(*it)->isDone()) {
+			requeue(std::move(*it));
+		} else {
+			clearDeadline(**it);
+		}
+	}
+
+	inFlight.clear();
+}
+
+void AsyncPostgres::evictPreparedStatements(sz_t keep) {
+	// statements still being prepared are never evicted, the query using them is waiting for it
+	for (auto it = preparedStatements.end(); preparedCache.size() > keep && it != preparedStatements.begin();) {
+		--it;
+		if (!it->second.ready) {
+			continue;
+		}
+
+		// sent before any queries that could be still waiting in the queue
+		auto q = query(std::numeric_limits<int>::max(), "DEALLOCATE " + it->second.name);
+		q->cacheable = false;
+		q->pinned = true; // another connection could have a different statement with this name
+
+		preparedCache.erase(it->first);
+		it = preparedStatements.erase(it);
+		++preparedEvictions;
+	}
+}
+
+void AsyncPostgres::clearPreparedStatements() {
+	// the statements are gone along with the server session, no need to deallocate them
+	preparedCache.clear();
+	preparedStatements.clear();
 }
 
-// won't work yet with single row mode cb
 void AsyncPostgres::currentCommandReturnedResult(PGresult * r, bool finished) {
-	// XXX: no check if empty, shouldn't happen anyways
-	if (finished) {
-		// if (debugPrinting) {
-		// 	std::cout << "[SQL] Query finished." << std::endl;
-		// }
+	if (inFlight.empty()) {
+		std::cerr << "[Postgre/currentCommandReturnedResult()]: Result without a query, status "
+			<< PQresStatus(PQresultStatus(r)) << std::endl;
+		PQclear(r);
+		return;
+	}
+
+	Query& q = *inFlight.front();
+	if (q.isDone()) {
+		// the pipelined execute of a statement that failed to prepare, the query already got that error
+		PQclear(r);
+		return;
+	}
 
-		(*currentQuery)->done(Result(r, nullptr));
-		queries.erase(currentQuery);
+	if (q.preparing) {
+		auto search = preparedCache.find(q.command);
+		if (PQresultStatus(r) == PGRES_COMMAND_OK) {
+			// the query itself is sent once the null result for the prepare command is read
+			if (search != preparedCache.end()) {
+				search->second->second.ready = true;
+			}
 
-		awaitingResponse = false;
-		currentQuery = queries.end();
-		signalCompletion();
-	} else {
-		// the connection pointer is needed to copy data
-		(*currentQuery)->done(Result(r, pgConn.get()));
+			PQclear(r);
+			return;
+		}
+
+		// the query would've failed in the same way, let it get the error
+		if (search != preparedCache.end()) {
+			preparedStatements.erase(search->second);
+			preparedCache.erase(search);
+		}
+
+		// a pipelined execute still has results coming, the prepare's end is handled in manageSocketEvents()
+		q.preparing = q.executePipelined;
 	}
+
+	if (statsEnabled) {
+		if (q.firstResultAt == std::chrono::steady_clock::time_point{}) {
+			q.firstResultAt = std::chrono::steady_clock::now();
+		}
+
+		q.rowsReturned += PQntuples(r);
+		ExecStatusType s = PQresultStatus(r);
+		q.failed |= s == PGRES_BAD_RESPONSE || s == PGRES_FATAL_ERROR || s == PGRES_PIPELINE_ABORTED;
+	}
+
+	Result res(r, finished ? nullptr : pgConn.get(), finished ? nullptr : this);
+	res.timedOut = q.timedOut && !res.success();
+
+	// if finished, the query is removed from the in-flight list once the null result is read.
+	// if not, the connection pointer is needed to copy data
+	q.done(std::move(res));
 }
 
 void AsyncPostgres::manageSocketEvents(bool needsWrite) {
-	if (!PQisBusy(pgConn.get())) {
-		while (PGresult * r = PQgetResult(pgConn.get())) {
-			bool finished = true;
-
-			ExecStatusType s = PQresultStatus(r);
-			//std::cout << "Popcb " << PQresStatus(s) << std::endl;
-			switch (s) { // FIXME?: make it possible to enable single row mode
-				case PGRES_COPY_IN:
-				case PGRES_COPY_OUT:
-					finished = false; // user has to copy data still
-					break;
-
-				case PGRES_BAD_RESPONSE:
-				case PGRES_FATAL_ERROR:
-					std::cerr << "[Postgre/manageSocketEvents()]: Bad result status " << PQresStatus(s) << std::endl;
-					printLastError();
-					break;
-
-				default:
-					break;
+	if (copyWaiter && copyWaiter->step()) {
+		std::exchange(copyWaiter, nullptr)->coro.resume();
+	}
+
+	while (!copying && !resultsBacklogged() && !PQisBusy(pgConn.get())) {
+		PGresult * r = PQgetResult(pgConn.get());
+		if (!r) {
+			// end of the results of the oldest sent query
+			if (inFlight.empty()) {
+				break;
+			}
+
+			if (inFlight.front()->preparing && inFlight.front()->executePipelined) {
+				// the prepare is done, the results of the execute come next
+				inFlight.front()->preparing = false;
+				if (!inFlight.front()->isDone()) {
+					setRowMode();
+				}
+
+				continue;
 			}
 
-			currentCommandReturnedResult(r, finished);
+			if (inFlight.front()->preparing) {
+				auto q = std::move(inFlight.front());
+				inFlight.pop_front();
+				sendPreparedQuery(std::move(q));
+				continue;
+			}
+
+			if (!inFlight.front()->isDone()) {
+				break;
+			}
+
+			if (statsEnabled) {
+				recordStats(*inFlight.front());
+			}
+
+			clearDeadline(*inFlight.front());
+			inFlight.pop_front();
+			signalCompletion();
+			continue;
+		}
+
+		bool finished = true;
+
+		ExecStatusType s = PQresultStatus(r);
+		//std::cout << "Popcb " << PQresStatus(s) << std::endl;
+		switch (s) {
+			case PGRES_PIPELINE_SYNC:
+				--pipelineSyncsPending;
+				PQclear(r);
+				if (!inFlight.empty()) {
+					setRowMode(); // the next query in the pipeline starts now
+				}
+
+				continue;
+
+			case PGRES_COPY_IN:
+			case PGRES_COPY_OUT:
+				finished = false; // user has to copy data still
+				copying = true;
+				break;
+
+			case PGRES_BAD_RESPONSE:
+			case PGRES_FATAL_ERROR:
+			case PGRES_PIPELINE_ABORTED:
+				std::cerr << "[Postgre/manageSocketEvents()]: Bad result status " << PQresStatus(s) << std::endl;
+				printLastError();
+				break;
+
+			default:
+				break;
+		}
+
+		currentCommandReturnedResult(r, finished);
+		if (!finished) {
+			break; // the rest of the results will arrive after the copy is done
 		}
 	}
 
-	// always listen for read because the server can send us notifs at any time
-	int evs = Poll::Evt::READABLE;
-	evs |= needsWrite ? Poll::Evt::WRITABLE : 0;
+	updateSocketEvents(needsWrite);
+}
+
+void AsyncPostgres::updateSocketEvents(bool needsWrite) {
+	// always listen for read because the server can send us notifs at any time,
+	// unless results would pile up in memory faster than they're consumed
+	readPaused = resultsBacklogged();
+	int evs = readPaused ? 0 : Poll::Evt::READABLE;
+	evs |= needsWrite || (copyWaiter && copyWaiter->wantsWrite()) ? Poll::Evt::WRITABLE : 0;
+
+	if (readPaused && !readResumeTimer) {
+		// Query::takeResult() resumes reading, this is for queries dropped without being drained
+		readResumeTimer = tc.timer([this] {
+			if (resultsBacklogged()) {
+				return true;
+			}
+
+			signalCompletion();
+			return false;
+		}, 50ms);
+	}
 
 	pSock->change(evs);
 }
 
+bool AsyncPostgres::resultsBacklogged() const {
+	// if only the in-flight list holds the query nobody can drain it
+	return !inFlight.empty() && inFlight.front()->backlog.size() >= Query::maxBacklog
+		&& inFlight.front().use_count() > 1;
+}
+
+void AsyncPostgres::recordStats(const Query& q) {
+	using namespace std::chrono;
+	static constexpr sz_t maxCommands = 1024;
+
+	// queries made before stats were enabled don't have all timestamps
+	if (q.enqueuedAt == steady_clock::time_point{} || q.sentAt == steady_clock::time_point{}) {
+		return;
+	}
+
+	auto& cmds = queryStats.commands;
+	auto it = cmds.find(q.command);
+	if (it == cmds.end()) {
+		it = cmds.try_emplace(cmds.size() < maxCommands ? q.command : std::string{"(other)"}).first;
+	}
+
+	auto now = steady_clock::now();
+	auto us = [] (auto d) { return static_cast<u64>(duration_cast<microseconds>(d).count()); };
+	CommandStats& cs = it->second;
+	cs.queueWait.add(us(q.sentAt - q.enqueuedAt));
+	cs.serverTime.add(us(now - q.sentAt));
+	if (q.firstResultAt != steady_clock::time_point{}) {
+		cs.firstResult.add(us(q.firstResultAt - q.sentAt));
+	}
+
+	cs.rows.add(q.rowsReturned);
+	cs.errors += q.failed;
+}
+
+void AsyncPostgres::setDeadline(Query& q, std::chrono::steady_clock::time_point deadline) {
+	clearDeadline(q);
+	q.deadline = deadline;
+	q.deadlineIt = deadlines.emplace(deadline, &q);
+	if (!deadlineTimer) {
+		deadlineTimer = tc.timer([this] {
+			return checkDeadlines();
+		}, 50ms);
+	}
+}
+
+void AsyncPostgres::clearDeadline(Query& q) {
+	if (q.deadlineIt != deadlines.end()) {
+		deadlines.erase(std::exchange(q.deadlineIt, deadlines.end()));
+		q.deadline = {};
+	}
+}
+
+bool AsyncPostgres::checkDeadlines() {
+	auto now = std::chrono::steady_clock::now();
+	std::vector<ll::shared_ptr<Query>> expired;
+	for (auto it = deadlines.begin(); it != deadlines.end() && it->first <= now; ++it) {
+		Query& q = *it->second;
+		if (!q.sent) {
+			if (auto qp = queries.erase(q)) {
+				expired.emplace_back(std::move(qp));
+			}
+
+			continue;
+		}
+
+		// with pipelining, the query can only be cancelled once the server is running it.
+		// if another cancel is still outstanding, this is tried again on the next check
+		if (!q.timedOut && !q.isDone() && !inFlight.empty() && inFlight.front().get() == &q) {
+			q.timedOut = requestServerCancel();
+		}
+	}
+
+	// callbacks are only called after iterating, they could make or cancel other queries
+	for (auto& q : expired) {
+		expire(std::move(q));
+	}
+
+	return !deadlines.empty();
+}
+
+void AsyncPostgres::expire(ll::shared_ptr<Query> q) {
+	clearDeadline(*q);
+	q->timedOut = true;
+	Result r(nullptr, nullptr);
+	r.timedOut = true;
+	q->done(std::move(r));
+}
+
+bool AsyncPostgres::requestServerCancel() {
+	// the flag is shared with the worker, it can still be set after we're destroyed
+	if (cancelPending->load(std::memory_order_acquire)) {
+		return false;
+	}
+
+	PGcancel * c = PQgetCancel(pgConn.get());
+	if (!c) {
+		return false;
+	}
+
+	cancelPending->store(true, std::memory_order_relaxed);
+	CancelWorker::get().push(c, cancelPending);
+	return true;
+}
+
+void AsyncPostgres::listen(const std::string& channel, bool state) {
+	if (!isConnected()) {
+		return; // all channels are listened to once connected
+	}
+
+	std::string cmd(state ? "LISTEN \"" : "UNLISTEN \"");
+	for (char c : channel) {
+		cmd += c;
+		if (c == '"') {
+			cmd += '"';
+		}
+	}
+
+	cmd += '"';
+	// before any other queries, so no notifications are missed after them
+	auto q = query(std::numeric_limits<int>::max(), std::move(cmd));
+	q->cacheable = false;
+	q->pin(); // notifications are only dispatched from this connection
+}
+
+void AsyncPostgres::unsubscribe(ChannelList::iterator ch, HandlerList::iterator h) {
+	if (ch->dispatching) {
+		*h = nullptr; // removed after dispatching
+		return;
+	}
+
+	ch->handlers.erase(h);
+	if (ch->handlers.empty()) {
+		listen(ch->name, false);
+		channels.erase(ch->name);
+		channelList.erase(ch);
+	}
+}
+
+void AsyncPostgres::dispatchNotification(const Notification& n) {
+	auto search = channels.find(n.channelName());
+	if (search == channels.end()) {
+		return;
+	}
+
+	auto ch = search->second;
+	ch->dispatching = true;
+	for (auto& f : ch->handlers) {
+		if (f) {
+			f(n);
+		}
+	}
+
+	ch->dispatching = false;
+	ch->handlers.remove_if([] (const auto& f) { return !f; });
+	if (ch->handlers.empty()) {
+		listen(ch->name, false);
+		channels.erase(ch->name);
+		channelList.erase(ch);
+	}
+}
+
+void AsyncPostgres::endCopy() {
+	copying = false;
+	if (copyWaiter) {
+		// not resumed here, the coroutine could use or destroy this connection while it's being torn down
+		failedCopyWaiter = std::exchange(copyWaiter, nullptr);
+		signalCompletion();
+	}
+}
+
 std::string_view AsyncPostgres::getLastErrorFirstLine() {
 	std::string_view err(PQerrorMessage(pgConn.get()));
 
@@ -346,6 +1076,7 @@ void AsyncPostgres::socketCallback(Poll& p, int s, int e) {
 
 		while (PGnotify * np = PQnotifies(pgConn.get())) {
 			Notification n{np};
+			dispatchNotification(n);
 			if (notifFunc) {
 				notifFunc(std::move(n));
 			}
@@ -359,20 +1090,141 @@ void AsyncPostgres::socketCallback(Poll& p, int s, int e) {
 	manageSocketEvents(needsWrite);
 }
 
+AsyncPostgres::QueryQueue::QueryQueue()
+: buckets(),
+  defaultBucket(buckets.emplace(0, Fifo{}).first),
+  total(0) { }
+
+AsyncPostgres::QueryQueue::~QueryQueue() {
+	// release the references the queries hold to themselves, this calls their callbacks
+	while (!empty()) {
+		pop();
+	}
+}
+
+void AsyncPostgres::QueryQueue::push(ll::shared_ptr<Query> q) {
+	Fifo& f = bucketFor(q->priority)->second;
+	Query& ref = *q;
+	ref.queueRef = std::move(q);
+	ref.queueNext = nullptr;
+	ref.queuePrev = f.tail;
+	(f.tail ? f.tail->queueNext : f.head) = &ref;
+	f.tail = &ref;
+	++f.count;
+	++total;
+}
+
+void AsyncPostgres::QueryQueue::pushFront(ll::shared_ptr<Query> q) {
+	Fifo& f = bucketFor(q->priority)->second;
+	Query& ref = *q;
+	ref.queueRef = std::move(q);
+	ref.queuePrev = nullptr;
+	ref.queueNext = f.head;
+	(f.head ? f.head->queuePrev : f.tail) = &ref;
+	f.head = &ref;
+	++f.count;
+	++total;
+}
+
+AsyncPostgres::Query& AsyncPostgres::QueryQueue::front() {
+	return *frontBucket()->second.head;
+}
+
+ll::shared_ptr<AsyncPostgres::Query> AsyncPostgres::QueryQueue::pop() {
+	auto it = frontBucket();
+	return unlink(it, *it->second.head);
+}
+
+ll::shared_ptr<AsyncPostgres::Query> AsyncPostgres::QueryQueue::erase(Query& q) {
+	if (!q.queueRef) {
+		return nullptr;
+	}
+
+	auto it = q.priority == 0 ? defaultBucket : buckets.find(q.priority);
+	return unlink(it, q);
+}
+
+bool AsyncPostgres::QueryQueue::empty() const {
+	return total == 0;
+}
+
+sz_t AsyncPostgres::QueryQueue::size() const {
+	return total;
+}
+
+sz_t AsyncPostgres::QueryQueue::countAhead(int priority) const {
+	sz_t n = 0;
+	for (auto it = buckets.begin(); it != buckets.end() && it->first >= priority; ++it) {
+		n += it->second.count;
+	}
+
+	return n;
+}
+
+AsyncPostgres::QueryQueue::BucketMap::iterator AsyncPostgres::QueryQueue::bucketFor(int priority) {
+	return priority == 0 ? defaultBucket : buckets.try_emplace(priority).first;
+}
+
+AsyncPostgres::QueryQueue::BucketMap::iterator AsyncPostgres::QueryQueue::frontBucket() {
+	// only the bucket of priority 0 can be empty
+	auto it = buckets.begin();
+	return it->second.count == 0 ? std::next(it) : it;
+}
+
+ll::shared_ptr<AsyncPostgres::Query> AsyncPostgres::QueryQueue::unlink(BucketMap::iterator it, Query& q) {
+	Fifo& f = it->second;
+	(q.queuePrev ? q.queuePrev->queueNext : f.head) = q.queueNext;
+	(q.queueNext ? q.queueNext->queuePrev : f.tail) = q.queuePrev;
+	q.queueNext = nullptr;
+	q.queuePrev = nullptr;
+	--f.count;
+	--total;
+
+	if (f.count == 0 && it != defaultBucket) {
+		buckets.erase(it);
+	}
+
+	return std::move(q.queueRef);
+}
+
 AsyncPostgres::Query::Query(AsyncPostgres& ap, int prio, std::stop_token st, std::string cmd, const char * const * vals, const int * lens, const int * fmts, int n)
-: ap(ap),
-  stopCb(std::move(st), [this] { this->ap.cancelQuery(*this); }),
+: ap(&ap),
+  stopCb(std::move(st), [this] { this->ap->cancelQuery(*this); }),
   command(std::move(cmd)),
   coro(nullptr),
   values(vals),
   lengths(lens),
   formats(fmts),
+  queueRef(nullptr),
+  queueNext(nullptr),
+  queuePrev(nullptr),
   nParams(n),
   priority(prio),
+  resultFormat(ap.binaryResults ? 1 : 0),
+  chunkRows(0),
+  rowsReturned(0),
+  enqueuedAt(ap.statsEnabled ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{}),
+  sentAt(),
+  firstResultAt(),
+  deadline(),
+  deadlineIt(ap.deadlines.end()),
   expectsResults(true),
-  cancelled(false) { }
+  cancelled(false),
+  sent(false),
+  cacheable(true),
+  pinned(false),
+  preparing(false),
+  executePipelined(false),
+  rowModeSet(false),
+  failed(false),
+  timedOut(false) { }
 
 AsyncPostgres::Query::~Query() {
+	// checkDeadlines() must never see a dead query, ap isn't touched if there's no deadline
+	if (deadline != std::chrono::steady_clock::time_point{}) {
+		ap->clearDeadline(*this);
+	}
+
 	if (expectsResults) {
 		// tell callback we couldn't complete the request
 		done(AsyncPostgres::Result(nullptr, nullptr));
@@ -385,6 +1237,14 @@ void AsyncPostgres::Query::setPointers(const char* const* _vals, const int* _len
 	formats = _formats;
 }
 
+void AsyncPostgres::Query::pin() {
+	pinned = true;
+}
+
+AsyncPostgres& AsyncPostgres::Query::getConnection() const {
+	return *ap;
+}
+
 void AsyncPostgres::Query::markCancelled() {
 	cancelled = true;
 }
@@ -393,9 +1253,23 @@ bool AsyncPostgres::Query::isDone() const {
 	return !expectsResults;
 }
 
+void AsyncPostgres::Query::setDeadline(std::chrono::steady_clock::time_point d) {
+	if (!isDone()) {
+		ap->setDeadline(*this, d);
+	}
+}
+
+void AsyncPostgres::Query::setTimeout(std::chrono::milliseconds t) {
+	setDeadline(std::chrono::steady_clock::now() + t);
+}
+
 void AsyncPostgres::Query::then(std::function<void(AsyncPostgres::Result)> f) {
 	if (res) {
-		f(std::move(res));
+		f(takeResult());
+	}
+
+	while (!backlog.empty()) {
+		f(takeResult());
 	}
 
 	if (expectsResults) {
@@ -423,11 +1297,16 @@ AsyncPostgres::Result AsyncPostgres::Query::await_resume() {
 		throw OpCancelledException{};
 	}
 
-	if (!res.success()) {
-		res.throwStatus();
+	Result r = takeResult();
+	if (!r.success()) {
+		r.throwStatus();
 	}
 
-	return std::move(res);
+	return r;
+}
+
+AsyncPostgres::Query::RowsAwaiter AsyncPostgres::Query::nextRows() {
+	return {*this};
 }
 
 void AsyncPostgres::Query::print() {
@@ -444,31 +1323,77 @@ bool AsyncPostgres::Query::operator<(const Query& q) const {
 
 int AsyncPostgres::Query::send(PGconn * conn) {
 	return PQsendQueryParams(conn, command.c_str(), nParams,
-		nullptr, values, lengths, formats, 0);
+		nullptr, values, lengths, formats, resultFormat);
+}
+
+int AsyncPostgres::Query::sendPrepare(PGconn * conn, const char * name) {
+	return PQsendPrepare(conn, name, command.c_str(), nParams, nullptr);
+}
+
+int AsyncPostgres::Query::sendPrepared(PGconn * conn, const char * name) {
+	return PQsendQueryPrepared(conn, name, nParams,
+		values, lengths, formats, resultFormat);
 }
 
 void AsyncPostgres::Query::done(AsyncPostgres::Result r) {
 	expectsResults = r.expectMoreResults();
-	res = std::move(r);
 	if (onDone) {
-		onDone(std::move(res));
-		res = {};
+		onDone(std::move(r));
 		if (!expectsResults) {
 			onDone = nullptr; // make it impossible to double-complete
 		}
+	} else if (res.isNull()) {
+		res = std::move(r);
+	} else {
+		backlog.emplace_back(std::move(r));
 	}
-	if (coro) {
-		coro.resume();
-		coro = nullptr;
+
+	if (coro) { // the coroutine could await again when resumed
+		std::exchange(coro, nullptr).resume();
 	}
 }
 
-AsyncPostgres::QueryQueue::const_iterator AsyncPostgres::Query::getQueueIterator() const {
-	return queue_it;
+AsyncPostgres::Result AsyncPostgres::Query::takeResult() {
+	Result r = std::move(res);
+	res = {};
+	if (!backlog.empty()) {
+		res = std::move(backlog.front());
+		backlog.pop_front();
+		if (ap->readPaused && backlog.size() == maxBacklog / 2) {
+			ap->signalCompletion(); // caught up enough, read more from the next loop iteration
+		}
+	}
+
+	return r;
 }
 
-void AsyncPostgres::Query::setQueueIterator(AsyncPostgres::QueryQueue::const_iterator it) {
-	queue_it = it;
+AsyncPostgres::Query::RowsAwaiter::RowsAwaiter(Query& q)
+: q(q) { }
+
+bool AsyncPostgres::Query::RowsAwaiter::await_ready() const noexcept {
+	return q.cancelled || !q.res.isNull() || q.isDone();
+}
+
+void AsyncPostgres::Query::RowsAwaiter::await_suspend(std::coroutine_handle<> h) {
+	q.coro = std::move(h);
+}
+
+AsyncPostgres::Result AsyncPostgres::Query::RowsAwaiter::await_resume() {
+	if (q.cancelled) {
+		throw OpCancelledException{};
+	}
+
+	Result r = q.takeResult();
+	if (r.isNull()) {
+		return r; // no more rows
+	}
+
+	if (!r.success()) {
+		r.throwStatus();
+	}
+
+	// the final result is empty unless the row mode couldn't be set
+	return r.expectMoreResults() || r.size() > 0 ? std::move(r) : Result{};
 }
 
 AwaiterProxy<AsyncPostgres::Query> operator co_await(ll::shared_ptr<AsyncPostgres::Query> q) {
@@ -477,12 +1402,26 @@ AwaiterProxy<AsyncPostgres::Query> operator co_await(ll::shared_ptr<AsyncPostgre
 	return {*q};
 }
 
+AsyncPostgres::View::View(const void * ptr, sz_t size)
+: ptr(static_cast<const char *>(ptr)),
+  size(size) { }
+
+const char * AsyncPostgres::View::data() const {
+	return ptr;
+}
+
+int AsyncPostgres::View::dataSizeBytes() const {
+	return size;
+}
+
 AsyncPostgres::Result::Result()
 : Result(nullptr, nullptr) { }
 
-AsyncPostgres::Result::Result(PGresult * r, PGconn * c)
+AsyncPostgres::Result::Result(PGresult * r, PGconn * c, AsyncPostgres * ap)
 : pgResult(r, PQclear),
-  conn(c) { }
+  conn(c),
+  ap(ap),
+  timedOut(false) { }
 
 sz_t AsyncPostgres::Result::numAffected() const {
 	if (!pgResult) {
@@ -503,12 +1442,19 @@ sz_t AsyncPostgres::Result::rowSize() const {
 }
 
 bool AsyncPostgres::Result::success() const {
+	if (timedOut) {
+		return false;
+	}
+
 	switch (getStatus()) {
 		case PGRES_COPY_OUT:
 		case PGRES_COPY_IN:
 		case PGRES_COMMAND_OK:
 		case PGRES_TUPLES_OK:
 		case PGRES_SINGLE_TUPLE:
+#ifdef LIBPQ_HAS_CHUNK_MODE
+		case PGRES_TUPLES_CHUNK:
+#endif
 			return true;
 
 		default:
@@ -523,6 +1469,9 @@ bool AsyncPostgres::Result::expectMoreResults() const {
 		case PGRES_COPY_OUT:
 		case PGRES_COPY_IN:
 		case PGRES_SINGLE_TUPLE:
+#ifdef LIBPQ_HAS_CHUNK_MODE
+		case PGRES_TUPLES_CHUNK:
+#endif
 			return true;
 
 		default:
@@ -541,6 +1490,10 @@ const char* AsyncPostgres::Result::getErrorMessage() const {
 }
 
 void AsyncPostgres::Result::throwStatus() const {
+	if (timedOut) {
+		throw TimeoutError{getStatus(), pgResult ? getErrorMessage() : "query timed out"};
+	}
+
 	throw Error{getStatus(), getErrorMessage()};
 }
 
@@ -548,6 +1501,27 @@ bool AsyncPostgres::Result::canCopyTo() const {
 	return getStatus() == PGRES_COPY_IN;
 }
 
+bool AsyncPostgres::Result::canCopyFrom() const {
+	return getStatus() == PGRES_COPY_OUT;
+}
+
+bool AsyncPostgres::Result::isNull() const {
+	return !pgResult;
+}
+
+bool AsyncPostgres::Result::isTimeout() const {
+	return timedOut;
+}
+
+int AsyncPostgres::Result::columnIndex(const char * name) const {
+	int i = pgResult ? PQfnumber(pgResult.get(), name) : -1;
+	if (i < 0) {
+		throw std::out_of_range(std::string("Result::columnIndex(): no column named ") + name);
+	}
+
+	return i;
+}
+
 bool AsyncPostgres::Result::blockingCopy(const char * buffer, sz_t nbytes) {
 	if (PQsetnonblocking(conn, false) == -1) {
 		return false;
@@ -567,9 +1541,25 @@ bool AsyncPostgres::Result::blockingCopyEnd(const char * err) {
 	int s = PQputCopyEnd(conn, err);
 
 	PQsetnonblocking(conn, true);
+	if (s == 1 && ap) {
+		ap->copying = false; // the final result will arrive next
+	}
+
 	return s == 1;
 }
 
+AsyncPostgres::CopyAwaiter AsyncPostgres::Result::copy(const char * buffer, sz_t nbytes) {
+	return {canCopyTo() ? ap : nullptr, CopyAwaiter::Op::WRITE, buffer, nbytes};
+}
+
+AsyncPostgres::CopyAwaiter AsyncPostgres::Result::copyEnd(const char * err) {
+	return {canCopyTo() ? ap : nullptr, CopyAwaiter::Op::END, err, 0};
+}
+
+AsyncPostgres::CopyReadAwaiter AsyncPostgres::Result::copyRead() {
+	return {canCopyFrom() ? ap : nullptr};
+}
+
 const char* AsyncPostgres::Result::Error::what() const noexcept {
 	return errMsg.c_str();
 }
@@ -672,6 +1662,173 @@ AsyncPostgres::Result::iterator::reference AsyncPostgres::Result::iterator::oper
 }
 
 
+AsyncPostgres::CopyData::CopyData()
+: CopyData(nullptr, 0) { }
+
+AsyncPostgres::CopyData::CopyData(char * b, int n)
+: buf(b, PQfreemem),
+  len(n) { }
+
+const char * AsyncPostgres::CopyData::data() const { return buf.get(); }
+sz_t AsyncPostgres::CopyData::size() const { return len; }
+std::string_view AsyncPostgres::CopyData::view() const { return {buf.get(), size()}; }
+AsyncPostgres::CopyData::operator bool() const { return buf != nullptr; }
+
+
+AsyncPostgres::CopyAwaiter::CopyAwaiter(AsyncPostgres * ap, Op op, const char * buf, sz_t size)
+: ap(ap),
+  coro(nullptr),
+  buf(buf),
+  size(size),
+  readData(),
+  op(op),
+  put(false),
+  ok(false) { }
+
+AsyncPostgres::CopyAwaiter::~CopyAwaiter() {
+	// the coroutine can be destroyed while suspended
+	if (ap && ap->copyWaiter == this) {
+		ap->copyWaiter = nullptr;
+		ap->updateSocketEvents(false);
+	} else if (ap && ap->failedCopyWaiter == this) {
+		ap->failedCopyWaiter = nullptr;
+	}
+}
+
+bool AsyncPostgres::CopyAwaiter::await_ready() {
+	// only one copy operation at a time, and only for the copy in progress
+	return !ap || !ap->copying || ap->copyWaiter || step();
+}
+
+void AsyncPostgres::CopyAwaiter::await_suspend(std::coroutine_handle<> h) {
+	coro = std::move(h);
+	ap->copyWaiter = this;
+	ap->updateSocketEvents(false);
+}
+
+bool AsyncPostgres::CopyAwaiter::await_resume() {
+	return ok;
+}
+
+bool AsyncPostgres::CopyAwaiter::step() {
+	PGconn * conn = ap->pgConn.get();
+	if (op == Op::READ) {
+		char * data = nullptr;
+		int n = PQgetCopyData(conn, &data, true);
+		switch (n) {
+			case 0: // wait for more data
+				return false;
+
+			case -1: // done, the final result can be read now
+				ap->copying = false;
+				ap->updateSocketEvents(true); // there might not be more socket activity to read it
+				ok = true;
+				break;
+
+			case -2:
+				ap->printLastError();
+				ok = false;
+				break;
+
+			default:
+				readData = CopyData(data, n);
+				ok = true;
+				break;
+		}
+
+		return true;
+	}
+
+	if (!put) {
+		int s = op == Op::WRITE
+			? PQputCopyData(conn, buf, size)
+			: PQputCopyEnd(conn, buf);
+
+		if (s == 0) {
+			return false; // try again when writable
+		} else if (s == -1) {
+			ok = false;
+			return true;
+		}
+
+		put = true;
+		if (op == Op::END) {
+			ap->copying = false; // the final result will arrive next
+		}
+	}
+
+	// only complete once the data is on its way, to give the caller some backpressure
+	switch (PQflush(conn)) {
+		case 0:
+			ok = true;
+			return true;
+
+		case 1:
+			return false;
+
+		default:
+			ok = false;
+			return true;
+	}
+}
+
+void AsyncPostgres::CopyAwaiter::fail() {
+	ok = false;
+	readData = {};
+	coro.resume();
+}
+
+bool AsyncPostgres::CopyAwaiter::wantsWrite() const {
+	return op != Op::READ;
+}
+
+AsyncPostgres::CopyReadAwaiter::CopyReadAwaiter(AsyncPostgres * ap)
+: CopyAwaiter(ap, Op::READ, nullptr, 0) { }
+
+AsyncPostgres::CopyData AsyncPostgres::CopyReadAwaiter::await_resume() {
+	if (!ok) {
+		throw std::runtime_error("COPY TO failed");
+	}
+
+	return std::move(readData);
+}
+
+
+AsyncPostgres::Subscription::Subscription(AsyncPostgres * ap, ChannelList::iterator ch, HandlerList::iterator h)
+: ap(ap),
+  channel(ch),
+  handler(h) { }
+
+AsyncPostgres::Subscription::Subscription()
+: ap(nullptr) { }
+
+AsyncPostgres::Subscription::~Subscription() {
+	unsubscribe();
+}
+
+AsyncPostgres::Subscription::Subscription(Subscription&& o) noexcept
+: ap(std::exchange(o.ap, nullptr)),
+  channel(o.channel),
+  handler(o.handler) { }
+
+AsyncPostgres::Subscription& AsyncPostgres::Subscription::operator=(Subscription&& o) noexcept {
+	unsubscribe();
+	ap = std::exchange(o.ap, nullptr);
+	channel = o.channel;
+	handler = o.handler;
+	return *this;
+}
+
+void AsyncPostgres::Subscription::unsubscribe() {
+	if (ap) {
+		std::exchange(ap, nullptr)->unsubscribe(channel, handler);
+	}
+}
+
+AsyncPostgres::Subscription::operator bool() const {
+	return ap;
+}
+
 AsyncPostgres::Notification::Notification(PGnotify * n)
 : pgNotify(n, [] (PGnotify * n) { PQfreemem(n); }) { }
 
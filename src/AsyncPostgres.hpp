@@ -6,15 +6,22 @@
 #include <string_view>
 #include <unordered_map>
 #include <memory>
+#include <deque>
+#include <list>
 #include <tuple>
 #include <iterator>
 #include <functional>
-#include <set>
+#include <map>
+#include <vector>
+#include <ranges>
 #include <type_traits>
 #include <typeindex>
 #include <stop_token>
+#include <chrono>
+#include <atomic>
 
 #include "TimedCallbacks.hpp"
+#include "Histogram.hpp"
 #include "explints.hpp"
 #include "tuple.hpp"
 #include "shared_ptr_ll.hpp"
@@ -27,39 +34,137 @@ class AsyncPostgres {
 public:
 	class Query;
 
-	struct QuerySharedPtrComparator {
-		bool operator()(const ll::shared_ptr<Query>& lhs, const ll::shared_ptr<Query>& rhs) const;
-	};
-
 	template<typename... Ts>
 	class TemplatedQuery;
+	template<typename T>
+	class Array;
+	class View;
 	class Result;
 	class Notification;
-	using QueryQueue = std::multiset<ll::shared_ptr<Query>, QuerySharedPtrComparator>;
+	class Subscription;
+	class CopyData;
+	class CopyAwaiter;
+	class CopyReadAwaiter;
+	struct PreparedStatementStats;
+
+	// times in microseconds. server time goes from sending the query to its last result
+	struct CommandStats {
+		Histogram queueWait;
+		Histogram firstResult;
+		Histogram serverTime;
+		Histogram rows;
+		u64 errors = 0;
+	};
+
+	struct Stats {
+		Histogram queueDepth; // sampled every time a query is queued
+		std::unordered_map<std::string, CommandStats> commands; // keyed by the command string
+	};
 
 private:
+	// queries waiting to be sent, by descending priority and FIFO within each one. queries are linked
+	// intrusively and own a reference to themselves while queued, so enqueueing and cancelling are O(1)
+	// besides the lookup of the priority's list, which is skipped for priority 0
+	class QueryQueue {
+		struct Fifo {
+			Query * head = nullptr;
+			Query * tail = nullptr;
+			sz_t count = 0;
+		};
+
+		using BucketMap = std::map<int, Fifo, std::greater<int>>;
+
+		BucketMap buckets; // the one for priority 0 always exists, empty ones of other priorities are removed
+		BucketMap::iterator defaultBucket;
+		sz_t total;
+
+	public:
+		QueryQueue();
+		~QueryQueue();
+
+		QueryQueue(const QueryQueue&) = delete;
+		const QueryQueue& operator=(const QueryQueue&) = delete;
+
+		void push(ll::shared_ptr<Query>);
+		void pushFront(ll::shared_ptr<Query>); // in front of the queries with the same priority
+		Query& front();
+		ll::shared_ptr<Query> pop();
+		ll::shared_ptr<Query> erase(Query&); // returns null if the query wasn't queued
+
+		bool empty() const;
+		sz_t size() const;
+		sz_t countAhead(int priority) const; // queries with a priority >= this one
+
+	private:
+		BucketMap::iterator bucketFor(int priority);
+		BucketMap::iterator frontBucket();
+		ll::shared_ptr<Query> unlink(BucketMap::iterator, Query&);
+	};
+
+	class CancelWorker; // defined in AsyncPostgres.cpp, shared by all connections
+
+	struct PreparedStatement {
+		std::string name;
+		bool ready; // false while the prepare command hasn't completed
+	};
+
+	using PreparedStatementList = std::list<std::pair<const std::string, PreparedStatement>>;
+	using DeadlineMap = std::multimap<std::chrono::steady_clock::time_point, Query *>;
+	using HandlerList = std::list<std::function<void(const Notification&)>>;
+
+	struct Channel {
+		std::string name;
+		HandlerList handlers; // empty functions are subscriptions removed during dispatch
+		bool dispatching;
+	};
+
+	using ChannelList = std::list<Channel>;
+
 	nev::Loop& loop;
 	TimedCallbacks& tc;
 	TimedCallbacks::TimerToken reconnectTimer;
 	TimedCallbacks::TimerToken qRetryTimer;
+	TimedCallbacks::TimerToken deadlineTimer;
+	TimedCallbacks::TimerToken readResumeTimer;
 
 	std::unique_ptr<nev::Async> nextCommandCaller;
 	std::unique_ptr<PGconn, void (*)(PGconn *)> pgConn;
 	std::unique_ptr<nev::Poll> pSock;
 	QueryQueue queries;
-	QueryQueue::const_iterator currentQuery; // queries.begin() could change at any time
-
+	std::deque<ll::shared_ptr<Query>> inFlight; // sent queries, results arrive in FIFO order
+	DeadlineMap deadlines; // of queries that haven't completed yet
+	CopyAwaiter * copyWaiter; // coroutine waiting for the socket to continue a COPY
+	CopyAwaiter * failedCopyWaiter; // its connection was lost, resumed with an error from the next loop iteration
+	std::shared_ptr<std::atomic<bool>> cancelPending; // set while the cancel worker has a request of ours
+
+	PreparedStatementList preparedStatements; // most recently used first
+	std::unordered_map<std::string_view, PreparedStatementList::iterator> preparedCache; // keyed by command
+	sz_t preparedCacheSize;
+	u64 preparedNameCounter;
+	u64 preparedHits;
+	u64 preparedMisses;
+	u64 preparedEvictions;
+	bool binaryResults;
+	bool copying; // results can't be read while a COPY is in progress
+	bool statsEnabled;
+	Stats queryStats;
+
+	ChannelList channelList;
+	std::unordered_map<std::string_view, ChannelList::iterator> channels; // keyed by the channel's name
 	std::function<void(Notification)> notifFunc;
 	std::function<void(ConnStatusType)> connChangeFunc;
+	sz_t pipelineDepth;
+	sz_t pipelineSyncsPending;
 	bool stopOnceEmpty;
 	bool busy;
-	bool awaitingResponse;
+	bool readPaused; // a streamed query's consumer fell behind, the socket isn't read until it catches up
 	bool autoReconnect;
 	
 	bool debugPrinting;
 
 public:
 	AsyncPostgres(nev::Loop&, TimedCallbacks&);
+	~AsyncPostgres();
 
 	void connect(std::unordered_map<std::string, std::string> connParams = {}, bool expandDbname = false);
 	bool reconnect(); // reconnects with the same parameters
@@ -69,6 +174,15 @@ public:
 
 	void setAutoReconnect(bool);
 	void setDebugPrinting(bool);
+	// results of queries made after this call come in binary, decoded by Row::get() without parsing text
+	void setBinaryResults(bool);
+	// max amount of queries sent without waiting for results, > 1 enables libpq's pipeline mode
+	void setPipelineDepth(sz_t);
+	// queries are prepared on the server on first use, and re-run by name afterwards. 0 disables the cache
+	void setPreparedStatementCacheSize(sz_t);
+	// records the latency of every query, per command string. commands past the first 1024 are counted together
+	void setStatsEnabled(bool);
+	void resetStats();
 
 	template<typename... Ts>
 	ll::shared_ptr<Query> query(int priority, std::stop_token, std::string, Ts&&...);
@@ -85,17 +199,38 @@ public:
 	template<typename... Ts>
 	ll::shared_ptr<Query> query(const char*, Ts&&...);
 
-	// cancel may fail, query callback will still be called, even if cancelled ok
+	// rows are handed to the query's callback (or Query::nextRows()) in results of up to chunkRows rows as
+	// they arrive, instead of all at once. chunk sizes > 1 need libpq 17, older versions get 1 row at a time.
+	// if nextRows() falls Query::maxBacklog results behind, the connection stops reading until it catches up
+	template<typename... Ts>
+	ll::shared_ptr<Query> streamQuery(int chunkRows, int priority, std::stop_token, std::string, Ts&&...);
+
+	// cancel may fail, query callback will still be called, even if cancelled ok.
+	// the cancel request for queries already sent is made from a worker thread, returns true if it was issued.
+	// only one is outstanding per connection at a time, false is returned while there is one
 	bool cancelQuery(Query&);
+	// queries that haven't been sent yet are queued on another connection instead, with the same priorities
+	// and deadlines. pinned ones stay. returns how many were moved
+	sz_t moveQueuedQueriesTo(AsyncPostgres&);
 
 	bool isConnected() const;
 	ConnStatusType getStatus() const;
 	sz_t queuedQueries() const;
+	sz_t inFlightQueries() const;
+	sz_t queriesAhead(int priority) const; // amount of queries that would be sent before one with this priority
+	sz_t getPipelineDepth() const;
+	bool isPipelining() const;
+	PreparedStatementStats preparedStatementStats() const;
+	const Stats& stats() const;
 	bool isAutoReconnectEnabled() const;
 	int backendPid() const;
 
 	void onConnectionStateChange(std::function<void(ConnStatusType)>);
+	// receives every notification, including the ones of subscribed channels
 	void onNotification(std::function<void(Notification)>);
+	// LISTENs to the channel while there are subscriptions to it, also after reconnecting.
+	// the channel name is case sensitive, like a quoted identifier
+	[[nodiscard]] Subscription subscribe(std::string channel, std::function<void(const Notification&)>);
 
 private:
 	void maybeSignalDisconnectionAndReconnect();
@@ -105,8 +240,32 @@ private:
 
 	void signalCompletion();
 	void processNextCommand();
+	sz_t maxInFlight() const;
+	bool awaitingExecute() const;
+	void updatePipelineMode();
+	bool sendPipelineSync();
+	int sendQuery(Query&);
+	bool addInFlight(ll::shared_ptr<Query>);
+	void setRowMode();
+	void sendPreparedQuery(ll::shared_ptr<Query>);
+	void requeue(ll::shared_ptr<Query>);
+	void requeueInFlight();
+	void evictPreparedStatements(sz_t keep);
+	void clearPreparedStatements();
 	void currentCommandReturnedResult(PGresult *, bool);
 	void manageSocketEvents(bool);
+	void updateSocketEvents(bool needsWrite);
+	bool resultsBacklogged() const;
+	void endCopy();
+	void recordStats(const Query&);
+	void setDeadline(Query&, std::chrono::steady_clock::time_point);
+	void clearDeadline(Query&);
+	bool checkDeadlines();
+	void expire(ll::shared_ptr<Query>);
+	bool requestServerCancel();
+	void listen(const std::string& channel, bool state);
+	void unsubscribe(ChannelList::iterator, HandlerList::iterator);
+	void dispatchNotification(const Notification&);
 
 	std::string_view getLastErrorFirstLine();
 	void printLastError();
@@ -115,19 +274,29 @@ private:
 	void socketCallback(nev::Poll&, int, int);
 };
 
+struct AsyncPostgres::PreparedStatementStats {
+	u64 hits;
+	u64 misses;
+	u64 evictions;
+	sz_t size;
+};
+
 class AsyncPostgres::Result {
 public:
 	class Error;
+	class TimeoutError;
 	class Row;
 	class iterator;
 
 private:
 	std::unique_ptr<PGresult, void (*)(PGresult *)> pgResult;
 	PGconn * conn;
+	AsyncPostgres * ap;
+	bool timedOut;
 
 public:
 	Result();
-	Result(PGresult *, PGconn *);
+	Result(PGresult *, PGconn *, AsyncPostgres * = nullptr);
 
 	sz_t numAffected() const;
 	sz_t size() const;
@@ -138,18 +307,59 @@ public:
 	const char* getErrorMessage() const;
 	[[noreturn]] void throwStatus() const;
 	bool canCopyTo() const;
+	bool canCopyFrom() const;
+	bool isNull() const;
+	bool isTimeout() const; // the query's deadline passed, the result can still hold the server's cancel error
 
 	bool blockingCopy(const char *, sz_t);
 	bool blockingCopyEnd(const char * err = nullptr);
 
+	// non-blocking versions for coroutines, the buffer must stay valid until the write is awaited.
+	// a write only completes once the data is sent, so the send buffer doesn't grow unbounded
+	CopyAwaiter copy(const char *, sz_t);
+	CopyAwaiter copyEnd(const char * err = nullptr);
+	CopyReadAwaiter copyRead(); // resolves to null data once the COPY TO is finished
+
 	iterator begin();
 	iterator end();
 
 	template<typename Func, typename Tuple = typename lambdaToTuple<Func>::type>
 	void forEach(Func);
 
+	int columnIndex(const char * name) const; // throws std::out_of_range if there's no such column
+
+	// column-oriented decoding, resolving the format of each column once instead of per field.
+	// a parse error throws Row::ParseException, and leaves the rows decoded before it in the output
+	template<typename T>
+	std::vector<T> column(int);
+
+	template<typename T>
+	std::vector<T> column(const char * name);
+
+	template<typename... Ts>
+	std::tuple<std::vector<Ts>...> columns(); // the first sizeof...(Ts) columns
+
+	// appends a T per row, assigning column i to the i-th member, e.g. decodeInto(users, &User::id, &User::name).
+	// throws Row::ParseException on the first row that can't be decoded, after appending the ones before it
+	template<typename T, typename... Ms>
+	void decodeInto(std::vector<T>&, Ms T::*...);
+
 	Row operator[](int);
 	operator bool() const;
+
+private:
+	template<typename T>
+	void decodeColumnInto(std::vector<T>&, int);
+
+	template<typename... Ts, std::size_t... Is>
+	std::tuple<std::vector<Ts>...> columnsImpl(std::index_sequence<Is...>);
+
+	template<typename T, std::size_t... Is, typename... Ms>
+	void decodeIntoImpl(std::vector<T>&, std::index_sequence<Is...>, Ms T::*...);
+
+public:
+
+	friend AsyncPostgres;
 };
 
 class AsyncPostgres::Result::Error : std::exception {
@@ -164,6 +374,11 @@ public:
 	const char* what() const noexcept override;
 };
 
+class AsyncPostgres::Result::TimeoutError : public AsyncPostgres::Result::Error {
+public:
+	using Error::Error;
+};
+
 class AsyncPostgres::Result::Row {
 public:
 	class ParseException;
@@ -227,6 +442,61 @@ public:
 	reference operator*() const;
 };
 
+class AsyncPostgres::CopyData {
+	std::unique_ptr<char, void (*)(void *)> buf;
+	int len;
+
+public:
+	CopyData();
+	CopyData(char *, int);
+
+	const char * data() const;
+	sz_t size() const;
+	std::string_view view() const;
+	operator bool() const;
+};
+
+class AsyncPostgres::CopyAwaiter {
+protected:
+	enum class Op : u8 {
+		WRITE,
+		END,
+		READ
+	};
+
+	AsyncPostgres * ap;
+	std::coroutine_handle<> coro;
+	const char * buf;
+	sz_t size;
+	CopyData readData;
+	Op op;
+	bool put;
+	bool ok;
+
+public:
+	CopyAwaiter(AsyncPostgres *, Op, const char *, sz_t);
+	~CopyAwaiter();
+
+	bool await_ready();
+	void await_suspend(std::coroutine_handle<> h);
+	bool await_resume();
+
+private:
+	bool step(); // returns true once the operation completed
+	void fail();
+	bool wantsWrite() const;
+
+	friend AsyncPostgres;
+	friend AsyncPostgres::Result;
+};
+
+class AsyncPostgres::CopyReadAwaiter : public AsyncPostgres::CopyAwaiter {
+public:
+	CopyReadAwaiter(AsyncPostgres *);
+
+	CopyData await_resume();
+};
+
 class AsyncPostgres::Notification {
 	std::unique_ptr<PGnotify, void (*)(PGnotify *)> pgNotify;
 
@@ -240,21 +510,70 @@ public:
 	friend AsyncPostgres;
 };
 
+// unsubscribes when destroyed, must not outlive the connection
+class AsyncPostgres::Subscription {
+	AsyncPostgres * ap;
+	ChannelList::iterator channel;
+	HandlerList::iterator handler;
+
+	Subscription(AsyncPostgres *, ChannelList::iterator, HandlerList::iterator);
+
+public:
+	Subscription();
+	~Subscription();
+
+	Subscription(const Subscription&) = delete;
+	const Subscription& operator=(const Subscription&) = delete;
+
+	Subscription(Subscription&&) noexcept;
+	Subscription& operator=(Subscription&&) noexcept;
+
+	void unsubscribe();
+	operator bool() const;
+
+	friend AsyncPostgres;
+};
+
 class AsyncPostgres::Query {
-	AsyncPostgres& ap;
+public:
+	class RowsAwaiter;
+
+	static constexpr sz_t maxBacklog = 32;
+
+private:
+	AsyncPostgres * ap; // changes if moved to another connection while queued
 	std::stop_callback<std::function<void(void)>> stopCb;
 	std::string command;
 	std::function<void(Result)> onDone;
 	std::coroutine_handle<> coro;
+	std::list<Result> backlog; // results that arrived before the previous one was awaited, see maxBacklog
 	const char * const * values;
 	const int * lengths;
 	const int * formats;
-	AsyncPostgres::QueryQueue::const_iterator queue_it;
+	ll::shared_ptr<Query> queueRef; // set while the query is queued, the queue doesn't hold other references
+	Query * queueNext;
+	Query * queuePrev;
 	int nParams;
 	const int priority;
+	const int resultFormat;
+	int chunkRows;
+	sz_t rowsReturned;
+	std::chrono::steady_clock::time_point enqueuedAt; // timestamps are only set if stats are enabled
+	std::chrono::steady_clock::time_point sentAt;
+	std::chrono::steady_clock::time_point firstResultAt;
+	std::chrono::steady_clock::time_point deadline;
+	AsyncPostgres::DeadlineMap::iterator deadlineIt; // valid if a deadline is set
 	Result res;
 	bool expectsResults;
 	bool cancelled;
+	bool sent;
+	bool cacheable; // can be sent as a prepared statement
+	bool pinned; // only makes sense on the connection it was made for
+	bool preparing; // the statement is being prepared, its results come before the query's own
+	bool executePipelined; // the query was sent right behind its prepare, otherwise it's sent once that completes
+	bool rowModeSet;
+	bool failed;
+	bool timedOut;
 
 public:
 	Query(AsyncPostgres&, int prio, std::stop_token, std::string, const char * const *, const int *, const int *, int);
@@ -265,11 +584,21 @@ public:
 
 	bool isDone() const;
 	void then(std::function<void(Result)>);
+	void pin(); // never moved to another connection
+	AsyncPostgres& getConnection() const; // the one it's queued on, or was sent through
+
+	// the query resolves with a timeout result (Result::TimeoutError when awaited) once the deadline passes.
+	// queued queries expire without being sent, running ones are cancelled on the server. 50ms resolution
+	void setDeadline(std::chrono::steady_clock::time_point);
+	void setTimeout(std::chrono::milliseconds);
 
 	bool await_ready() const noexcept;
 	void await_suspend(std::coroutine_handle<> h);
 	Result await_resume();
 
+	// for streamed queries, resolves to a null result once there are no more rows
+	RowsAwaiter nextRows();
+
 	void print();
 
 	bool operator>(const Query&) const;
@@ -277,19 +606,69 @@ public:
 
 private:
 	int send(PGconn *);
+	int sendPrepare(PGconn *, const char * name);
+	int sendPrepared(PGconn *, const char * name);
 	void done(Result);
-	AsyncPostgres::QueryQueue::const_iterator getQueueIterator() const;
-	void setQueueIterator(AsyncPostgres::QueryQueue::const_iterator);
+	Result takeResult();
 
 	friend AsyncPostgres;
+	friend AsyncPostgres::QueryQueue;
+};
+
+class AsyncPostgres::Query::RowsAwaiter {
+	Query& q;
+
+public:
+	RowsAwaiter(Query&);
+
+	bool await_ready() const noexcept;
+	void await_suspend(std::coroutine_handle<> h);
+	Result await_resume();
 };
 
 AwaiterProxy<AsyncPostgres::Query> operator co_await(ll::shared_ptr<AsyncPostgres::Query>);
 
+// query parameter sent as a one-dimensional postgres array in binary format. the parameter must be cast to the
+// matching array type in the query, e.g. $1::int4[] for i32s, since the element type is checked by the server
+template<typename T>
+class AsyncPostgres::Array {
+	std::vector<char> buf;
+
+public:
+	Array(const std::vector<T>&);
+
+	const char * data() const;
+	int dataSizeBytes() const;
+};
+
+// non-owning query parameter, to pass big buffers without copying them into the query. the memory must stay
+// valid and unchanged until the query is done, not only until it's sent, since queries are re-sent after reconnecting
+class AsyncPostgres::View {
+	const char * ptr;
+	int size;
+
+public:
+	View(const void *, sz_t);
+
+	// from lvalue contiguous containers, or views like std::span and std::string_view
+	template<typename C, typename = typename std::enable_if<std::ranges::contiguous_range<C>
+		&& std::ranges::borrowed_range<C>>::type>
+	View(C&&);
+
+	const char * data() const;
+	int dataSizeBytes() const;
+};
+
 template<typename... Ts>
 class AsyncPostgres::TemplatedQuery : public AsyncPostgres::Query {
-	// we want to store the actual values, not references/pointers to them, so decay types
-	std::tuple<typename std::decay<Ts>::type...> valueStorage;
+	// we want to store the actual values, not references/pointers to them, so decay types. rvalues are moved in.
+	// char arrays (string literals) are kept as views, with their length computed at the call site
+	template<typename T>
+	using Stored = typename std::conditional<std::is_array<typename std::remove_reference<T>::type>::value
+		&& std::is_same<typename std::decay<T>::type, const char *>::value,
+		std::string_view, typename std::decay<T>::type>::type;
+
+	std::tuple<Stored<Ts>...> valueStorage;
 	const std::array<const char *, sizeof... (Ts)> realValues;
 	const std::array<int, sizeof... (Ts)> realLengths;
 	const std::array<int, sizeof... (Ts)> realFormats;
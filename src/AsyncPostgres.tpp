@@ -4,10 +4,16 @@
 #include <type_traits>
 #include <stdexcept>
 #include <optional>
+#include <algorithm>
 #include <cstring>
+#include <limits>
+#include <bit>
+#include <string>
 #include <utility>
 
 #include "OpCancelledException.hpp"
+#include "PoolAllocator.hpp"
+#include "BufferHelper.hpp"
 #include "byteswap.hpp"
 #include "stringparser.hpp"
 #include "templateutils.hpp"
@@ -33,6 +39,18 @@ using dataSizeBytes_t = decltype(std::declval<T>().dataSizeBytes());
 template <typename T>
 using has_dataSizeBytes = detect<T, dataSizeBytes_t>;
 
+template <typename T>
+using size_bytes_t = decltype(std::declval<T>().size_bytes());
+
+template <typename T>
+using has_size_bytes = detect<T, size_bytes_t>; // std::span
+
+template <typename T>
+using fromPgData_t = decltype(std::declval<T>().fromPgData("", 0));
+
+template <typename T>
+using has_fromPgData = detect<T, fromPgData_t>;
+
 
 template<typename T>
 typename std::enable_if<is_optional<T>::value, T>::type
@@ -44,6 +62,8 @@ getValue(char * buf, sz_t size) {
 	using Tv = typename T::value_type;
 	if constexpr (has_fromString<Tv>::value) {
 		return Tv::fromString(buf, size);
+	} else if constexpr (is_vector<Tv>::value) {
+		throw std::invalid_argument("Arrays can only be read from binary results");
 	} else {
 		return fromString<Tv>(std::string_view(buf, size));
 	}
@@ -58,11 +78,269 @@ getValue(char * buf, sz_t size) {
 
 	if constexpr (has_fromString<T>::value) {
 		return T::fromString(buf, size);
+	} else if constexpr (is_vector<T>::value) {
+		throw std::invalid_argument("Arrays can only be read from binary results");
 	} else {
 		return fromString<T>(std::string_view(buf, size));
 	}
 }
 
+template<typename U>
+U readBigEndian(const char * p) {
+	return buf::readBE<U>(reinterpret_cast<const u8 *>(p));
+}
+
+template<typename T>
+void writeBigEndian(std::vector<char>& out, T value) {
+	sz_t off = out.size();
+	out.resize(off + sizeof(T));
+	buf::writeBE<T>(reinterpret_cast<u8 *>(out.data() + off), value);
+}
+
+template <typename T>
+using getPgData_t = decltype(std::declval<T>().getPgData());
+
+template <typename T>
+using has_getPgData = detect<T, getPgData_t>;
+
+// oid of the postgres type values of T are sent as inside of arrays
+template<typename T>
+constexpr u32 pgArrayElementOid() {
+	if constexpr (is_optional<T>::value) {
+		return pgArrayElementOid<typename T::value_type>();
+	} else if constexpr (std::is_same<T, bool>::value) {
+		return 16; // bool
+	} else if constexpr (std::is_integral<T>::value && sizeof(T) == 2) {
+		return 21; // int2
+	} else if constexpr (std::is_integral<T>::value && sizeof(T) == 4) {
+		return 23; // int4
+	} else if constexpr (std::is_integral<T>::value && sizeof(T) == 8) {
+		return 20; // int8
+	} else if constexpr (std::is_same<T, float>::value) {
+		return 700; // float4
+	} else if constexpr (std::is_same<T, double>::value) {
+		return 701; // float8
+	} else if constexpr (std::is_same<T, std::string>::value || std::is_same<T, std::string_view>::value) {
+		return 25; // text
+	} else if constexpr (std::is_same<T, std::vector<u8>>::value) {
+		return 17; // bytea
+	} else if constexpr (has_getPgData<T>::value) {
+		return 869; // inet
+	} else {
+		static_assert(sizeof(T) == 0, "Type not supported in arrays");
+	}
+}
+
+// writes the length and the value in binary send format
+template<typename T>
+void appendArrayElement(std::vector<char>& out, const T& value) {
+	if constexpr (is_optional<T>::value) {
+		if (!value) {
+			writeBigEndian<i32>(out, -1);
+		} else {
+			appendArrayElement(out, *value);
+		}
+	} else if constexpr (std::is_same<T, bool>::value) {
+		writeBigEndian<i32>(out, 1);
+		out.push_back(value ? 1 : 0);
+	} else if constexpr (std::is_integral<T>::value) {
+		writeBigEndian<i32>(out, sizeof(T));
+		writeBigEndian(out, value);
+	} else if constexpr (std::is_floating_point<T>::value) {
+		using U = typename std::conditional<sizeof(T) == 4, u32, u64>::type;
+		writeBigEndian<i32>(out, sizeof(T));
+		writeBigEndian(out, std::bit_cast<U>(value));
+	} else if constexpr (has_getPgData<T>::value) {
+		auto data = value.getPgData();
+		writeBigEndian<i32>(out, data.size());
+		out.insert(out.end(), data.begin(), data.end());
+	} else {
+		writeBigEndian<i32>(out, value.size());
+		out.insert(out.end(), value.begin(), value.end());
+	}
+}
+
+// unsigned types sent as-is, every other integer is range checked
+constexpr bool isUnsignedOid(u32 oid) {
+	switch (oid) {
+		case 24: // regproc
+		case 26: // oid
+		case 28: // xid
+		case 29: // cid
+		case 2202: case 2203: case 2204: case 2205: case 2206: // regprocedure, regoper, regoperator, regclass, regtype
+		case 3734: case 3769: case 4089: case 4096: // regconfig, regdictionary, regnamespace, regrole
+		case 5069: // xid8
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+constexpr bool isIntegerOid(u32 oid) {
+	switch (oid) {
+		case 20: // int8
+		case 21: // int2
+		case 23: // int4
+			return true;
+
+		default:
+			return isUnsignedOid(oid);
+	}
+}
+
+constexpr bool isFloatOid(u32 oid) {
+	return oid == 700 || oid == 701; // float4, float8
+}
+
+// types whose binary send format is the same as the text one
+constexpr bool isTextOid(u32 oid) {
+	switch (oid) {
+		case 17: // bytea
+		case 18: // char
+		case 19: // name
+		case 25: // text
+		case 114: // json
+		case 142: // xml
+		case 705: // unknown
+		case 1042: // bpchar
+		case 1043: // varchar
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+template<typename T>
+typename std::enable_if<is_optional<T>::value, T>::type
+getBinaryValue(const char * buf, sz_t size, u32 oid);
+
+template<typename T>
+typename std::enable_if<!is_optional<T>::value, T>::type
+getBinaryValue(const char * buf, sz_t size, u32 oid);
+
+template<typename T>
+T getBinaryArray(const char * buf, sz_t size) {
+	// ndim, has_nulls, element oid, (dim size, lower bound) * ndim, (length, data) * elements
+	using Te = typename T::value_type;
+	if (size < 12) {
+		throw std::invalid_argument("Invalid array data");
+	}
+
+	i32 ndim = readBigEndian<i32>(buf);
+	if (ndim == 0) {
+		return {};
+	} else if (ndim != 1 || size < 20) {
+		throw std::invalid_argument("Only one-dimensional arrays are supported");
+	}
+
+	u32 elemOid = readBigEndian<u32>(buf + 8);
+	i32 n = readBigEndian<i32>(buf + 12);
+	const char * it = buf + 20;
+	const char * end = buf + size;
+
+	T arr;
+	arr.reserve(n);
+	for (i32 i = 0; i < n; i++) {
+		if (end - it < 4) {
+			throw std::invalid_argument("Truncated array data");
+		}
+
+		i32 len = readBigEndian<i32>(it);
+		it += 4;
+		if (len > end - it) {
+			throw std::invalid_argument("Truncated array data");
+		}
+
+		arr.emplace_back(getBinaryValue<Te>(len < 0 ? nullptr : it, len < 0 ? 0 : len, elemOid));
+		it += len < 0 ? 0 : len;
+	}
+
+	return arr;
+}
+
+template<typename T>
+typename std::enable_if<is_optional<T>::value, T>::type
+getBinaryValue(const char * buf, sz_t size, u32 oid) {
+	if (!buf) {
+		return std::nullopt;
+	}
+
+	return getBinaryValue<typename T::value_type>(buf, size, oid);
+}
+
+// values come in network byte order, in the send format of the column type (oid)
+template<typename T>
+typename std::enable_if<!is_optional<T>::value, T>::type
+getBinaryValue(const char * buf, sz_t size, u32 oid) {
+	if (!buf) {
+		throw std::invalid_argument("Value was null on non-nullable result");
+	}
+
+	if constexpr (has_fromPgData<T>::value) {
+		return T::fromPgData(buf, size);
+	} else if constexpr (std::is_same<T, bool>::value) {
+		if (size != 1) {
+			throw std::invalid_argument("Invalid bool");
+		}
+
+		return buf[0] != 0;
+	} else if constexpr (std::is_integral<T>::value) {
+		// other types of the same size (floats, timestamps, money...) would be read as garbage
+		if (!isIntegerOid(oid)) {
+			throw std::invalid_argument("Column of type oid " + std::to_string(oid) + " can't be read as an integer from binary results");
+		}
+
+		if constexpr (std::is_unsigned<T>::value) {
+			if (size == sizeof(T) && isUnsignedOid(oid)) { // oids and such
+				return readBigEndian<T>(buf);
+			}
+		}
+
+		i64 n;
+		switch (size) {
+			case 2: n = readBigEndian<i16>(buf); break;
+			case 4: n = isUnsignedOid(oid) ? i64(readBigEndian<u32>(buf)) : i64(readBigEndian<i32>(buf)); break;
+			case 8: n = readBigEndian<i64>(buf); break;
+			default:
+				throw std::invalid_argument("Improperly sized integer (" + std::to_string(size) + " bytes)");
+		}
+
+		// the max is compared unsigned, i64(u64 max) would be -1
+		if (n < i64(std::numeric_limits<T>::min()) || (n > 0 && u64(n) > u64(std::numeric_limits<T>::max()))) {
+			throw std::out_of_range("Value too big/small");
+		}
+
+		return n;
+	} else if constexpr (std::is_floating_point<T>::value) {
+		if (!isFloatOid(oid)) {
+			throw std::invalid_argument("Column of type oid " + std::to_string(oid) + " can't be read as a float from binary results");
+		}
+
+		// a float8 read as a float is narrowed, like in text mode
+		switch (size) {
+			case 4: return std::bit_cast<float>(readBigEndian<u32>(buf));
+			case 8: return static_cast<T>(std::bit_cast<double>(readBigEndian<u64>(buf)));
+			default:
+				throw std::invalid_argument("Improperly sized float (" + std::to_string(size) + " bytes)");
+		}
+	} else if constexpr (std::is_same<T, std::string>::value) {
+		if (!isTextOid(oid)) {
+			throw std::invalid_argument("Column of type oid " + std::to_string(oid) + " can't be read as a string from binary results");
+		}
+
+		return std::string(buf, size);
+	} else if constexpr (is_vector<T>::value && sizeof(typename T::value_type) == 1
+			&& std::is_integral<typename T::value_type>::value) {
+		return T(buf, buf + size); // bytea
+	} else if constexpr (is_vector<T>::value) {
+		return getBinaryArray<T>(buf, size);
+	} else {
+		throw std::invalid_argument("Type can't be read from binary results");
+	}
+}
+
 template<typename T>
 typename std::enable_if<!std::is_null_pointer<T>::value
 		&& !has_const_iterator<T>::value
@@ -70,6 +348,8 @@ typename std::enable_if<!std::is_null_pointer<T>::value
 getDataPointer(const T& value) {
 	if constexpr (has_data<T>::value && has_dataSizeBytes<T>::value) {
 		return value.data();
+	} else if constexpr (has_data<T>::value && has_size_bytes<T>::value) {
+		return reinterpret_cast<const char *>(value.data());
 	} else {
 		static_assert(!std::is_class<T>::value,
 			"Class types must implement .data() and .dataSizeBytes() to be used in queries");
@@ -112,10 +392,12 @@ typename std::enable_if<!has_const_iterator<T>::value
 getSize(const T& value) {
 	if constexpr (has_data<T>::value && has_dataSizeBytes<T>::value) {
 		return value.dataSizeBytes();
+	} else if constexpr (has_data<T>::value && has_size_bytes<T>::value) {
+		return value.size_bytes();
 	} else if constexpr (std::is_pointer<T>::value) {
 		static_assert(std::is_same<T, const char *>::value,
 			"Use std::array or std::vector to pass non-text arrays!");
-		return strlen(value); // :(
+		return strlen(value); // :( pass a std::string_view if the length is known
 	} else {
 		return sizeof(T);
 	}
@@ -184,6 +466,13 @@ byteSwap(T& value) {
 	}
 }
 
+template<typename T>
+T decodeField(PGresult * r, int row, int col, bool binary) {
+	char * buf = PQgetisnull(r, row, col) ? nullptr : PQgetvalue(r, row, col);
+	sz_t size = PQgetlength(r, row, col);
+	return binary ? getBinaryValue<T>(buf, size, PQftype(r, col)) : getValue<T>(buf, size);
+}
+
 }
 
 template<typename... Ts>
@@ -206,14 +495,18 @@ template<typename... Ts>
 ll::shared_ptr<AsyncPostgres::Query> AsyncPostgres::query(int priority, std::stop_token st, std::string command, Ts&&... params) {
 	OpCancelledException::check(st);
 
-	if (!busy && isConnected()) {
+	if (isConnected() && inFlight.size() < maxInFlight()) {
 		signalCompletion();
 	}
 
-	// dereference the iterator returned by emplace, and the unique_ptr
-	auto it = queries.emplace(ll::make_shared<AsyncPostgres::TemplatedQuery<Ts...>>(*this, priority, std::move(st), std::move(command), std::forward<Ts>(params)...));
-	(*it)->setQueueIterator(it);
-	return *it;
+	using QueryType = AsyncPostgres::TemplatedQuery<Ts...>;
+	auto q = ll::allocate_shared<QueryType>(PoolAllocator<QueryType>{}, *this, priority, std::move(st), std::move(command), std::forward<Ts>(params)...);
+	queries.push(q);
+	if (statsEnabled) {
+		queryStats.queueDepth.add(queries.size());
+	}
+
+	return q;
 }
 
 template<typename... Ts>
@@ -236,6 +529,40 @@ ll::shared_ptr<AsyncPostgres::Query> AsyncPostgres::query(const char* command, T
 	return query(0, std::stop_token{}, std::string{command}, std::forward<Ts>(params)...);
 }
 
+template<typename... Ts>
+ll::shared_ptr<AsyncPostgres::Query> AsyncPostgres::streamQuery(int chunkRows, int priority, std::stop_token st, std::string command, Ts&&... params) {
+	auto q = query(priority, std::move(st), std::move(command), std::forward<Ts>(params)...);
+	q->chunkRows = std::max(chunkRows, 1); // fine to set here, queries are sent from the next loop iteration
+	return q;
+}
+
+template<typename T>
+AsyncPostgres::Array<T>::Array(const std::vector<T>& values) {
+	// ndim, has_nulls, element oid, (dim size, lower bound), (length, data) * elements
+	detail::writeBigEndian<i32>(buf, 1);
+	detail::writeBigEndian<i32>(buf, is_optional<T>::value);
+	detail::writeBigEndian<u32>(buf, detail::pgArrayElementOid<T>());
+	detail::writeBigEndian<i32>(buf, values.size());
+	detail::writeBigEndian<i32>(buf, 1);
+	for (const auto& v : values) {
+		detail::appendArrayElement(buf, v);
+	}
+}
+
+template<typename T>
+const char * AsyncPostgres::Array<T>::data() const {
+	return buf.data();
+}
+
+template<typename T>
+int AsyncPostgres::Array<T>::dataSizeBytes() const {
+	return buf.size();
+}
+
+template<typename C, typename>
+AsyncPostgres::View::View(C&& c)
+: View(std::ranges::data(c), std::ranges::size(c) * sizeof(std::ranges::range_value_t<C>)) { }
+
 template<typename Func, typename Tuple>
 void AsyncPostgres::Result::forEach(Func f) {
 	for (Row r : *this) {
@@ -243,14 +570,91 @@ void AsyncPostgres::Result::forEach(Func f) {
 	}
 }
 
+template<typename T>
+std::vector<T> AsyncPostgres::Result::column(int col) {
+	std::vector<T> out;
+	decodeColumnInto(out, col);
+	return out;
+}
+
+template<typename T>
+std::vector<T> AsyncPostgres::Result::column(const char * name) {
+	return column<T>(columnIndex(name));
+}
+
+template<typename... Ts>
+std::tuple<std::vector<Ts>...> AsyncPostgres::Result::columns() {
+	return columnsImpl<Ts...>(std::index_sequence_for<Ts...>{});
+}
+
+template<typename T, typename... Ms>
+void AsyncPostgres::Result::decodeInto(std::vector<T>& out, Ms T::*... members) {
+	decodeIntoImpl(out, std::index_sequence_for<Ms...>{}, members...);
+}
+
+template<typename T>
+void AsyncPostgres::Result::decodeColumnInto(std::vector<T>& out, int col) {
+	PGresult * r = pgResult.get();
+	int n = size();
+	if (n == 0) {
+		return;
+	}
+
+	bool binary = PQfformat(r, col) == 1;
+	out.reserve(out.size() + n);
+	try {
+		for (int row = 0; row < n; row++) {
+			out.emplace_back(detail::decodeField<T>(r, row, col, binary));
+		}
+	} catch (const std::exception& e) {
+		throw Row::ParseException({typeid(T)}, typeid(e), e.what());
+	}
+}
+
+template<typename... Ts, std::size_t... Is>
+std::tuple<std::vector<Ts>...> AsyncPostgres::Result::columnsImpl(std::index_sequence<Is...>) {
+	std::tuple<std::vector<Ts>...> out;
+	(decodeColumnInto(std::get<Is>(out), Is), ...);
+	return out;
+}
+
+template<typename T, std::size_t... Is, typename... Ms>
+void AsyncPostgres::Result::decodeIntoImpl(std::vector<T>& out, std::index_sequence<Is...>, Ms T::*... members) {
+	PGresult * r = pgResult.get();
+	int n = size();
+	if (n == 0) {
+		return;
+	}
+
+	const bool binary[] = {(PQfformat(r, Is) == 1)...};
+	out.reserve(out.size() + n);
+	try {
+		for (int row = 0; row < n; row++) {
+			// only pushed once every column decoded, a failed row must not be left half filled in out
+			T v{};
+			((v.*members = detail::decodeField<Ms>(r, row, Is, binary[Is])), ...);
+			out.emplace_back(std::move(v));
+		}
+	} catch (const std::exception& e) {
+		throw Row::ParseException({typeid(Ms)...}, typeid(e), e.what());
+	}
+}
+
 template<typename Tuple, std::size_t... Is>
 Tuple AsyncPostgres::Result::Row::getImpl(std::index_sequence<Is...>) {
 	try {
-		return {detail::getValue<typename std::tuple_element<Is, Tuple>::type>(
-			PQgetisnull(r, rowIndex, Is)
-			? nullptr
-			: PQgetvalue(r, rowIndex, Is),
-			PQgetlength(r, rowIndex, Is)
+		return {(PQfformat(r, Is) == 1
+			? detail::getBinaryValue<typename std::tuple_element<Is, Tuple>::type>(
+				PQgetisnull(r, rowIndex, Is)
+				? nullptr
+				: PQgetvalue(r, rowIndex, Is),
+				PQgetlength(r, rowIndex, Is),
+				PQftype(r, Is))
+			: detail::getValue<typename std::tuple_element<Is, Tuple>::type>(
+				PQgetisnull(r, rowIndex, Is)
+				? nullptr
+				: PQgetvalue(r, rowIndex, Is),
+				PQgetlength(r, rowIndex, Is))
 		)...};
 	} catch (const std::exception& e) {
 		throw ParseException({typeid(typename std::tuple_element<Is, Tuple>::type)...}, typeid(e), e.what());
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <chrono>
+#include <coroutine>
+#include <functional>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "AsyncPostgres.hpp"
+#include "explints.hpp"
+#include "shared_ptr_ll.hpp"
+#include "Poll.hpp"
+
+// coalesces many small queries of the same shape into a single round trip. the parameters of every call are
+// collected into one array per column, and sent as AsyncPostgres::Array<Ts> once the batch fills up or the time
+// window ends. the command has to expand the arrays itself, e.g.:
+//   INSERT INTO t (a, b) SELECT * FROM unnest($1::int4[], $2::text[])
+// every caller receives the shared result of the batch, and its index in it. the index matches the ordinality
+// of unnest(...) WITH ORDINALITY minus one, if the rows need to be matched back to their callers.
+// must be destroyed before the connection, pending calls are flushed on destruction.
+template<typename... Ts>
+class AsyncPostgresBatcher {
+public:
+	using ResultPtr = ll::shared_ptr<AsyncPostgres::Result>;
+	class Awaiter;
+
+private:
+	struct Entry {
+		std::function<void(ResultPtr, sz_t)> cb;
+		std::coroutine_handle<> coro;
+	};
+
+	struct Batch {
+		std::tuple<std::vector<Ts>...> columns;
+		std::vector<Entry> entries;
+		ResultPtr res;
+
+		void complete(AsyncPostgres::Result);
+	};
+
+	AsyncPostgres& ap;
+	std::unique_ptr<nev::Timer> windowTimer;
+	ll::shared_ptr<Batch> current;
+	std::string command;
+	sz_t maxBatch;
+	std::chrono::milliseconds window;
+	int priority;
+
+public:
+	AsyncPostgresBatcher(AsyncPostgres&, nev::Loop&, std::string command, sz_t maxBatch, std::chrono::milliseconds window, int priority = 0);
+	~AsyncPostgresBatcher();
+
+	AsyncPostgresBatcher(const AsyncPostgresBatcher&) = delete;
+	const AsyncPostgresBatcher& operator=(const AsyncPostgresBatcher&) = delete;
+
+	void add(std::function<void(ResultPtr, sz_t)>, Ts...);
+	Awaiter add(Ts...); // throws Result::Error from co_await if the batch failed
+
+	void flush();
+	sz_t pending() const;
+
+private:
+	sz_t push(Ts&&...);
+};
+
+template<typename... Ts>
+class AsyncPostgresBatcher<Ts...>::Awaiter {
+	ll::shared_ptr<Batch> batch;
+	sz_t index;
+
+public:
+	Awaiter(ll::shared_ptr<Batch>, sz_t);
+
+	bool await_ready() const noexcept;
+	void await_suspend(std::coroutine_handle<> h);
+	std::pair<ResultPtr, sz_t> await_resume();
+};
+
+#include "AsyncPostgresBatcher.tpp" // IWYU pragma: keep
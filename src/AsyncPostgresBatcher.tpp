@@ -0,0 +1,125 @@
+#pragma once
+#include "AsyncPostgresBatcher.hpp"
+
+#include <algorithm>
+#include <utility>
+
+template<typename... Ts>
+void AsyncPostgresBatcher<Ts...>::Batch::complete(AsyncPostgres::Result r) {
+	if (res) {
+		return; // only the first result of the command is passed on
+	}
+
+	res = ll::make_shared<AsyncPostgres::Result>(std::move(r));
+	for (sz_t i = 0; i < entries.size(); i++) {
+		if (entries[i].cb) {
+			entries[i].cb(res, i);
+		} else if (entries[i].coro) {
+			std::exchange(entries[i].coro, nullptr).resume();
+		}
+	}
+}
+
+template<typename... Ts>
+AsyncPostgresBatcher<Ts...>::AsyncPostgresBatcher(AsyncPostgres& ap, nev::Loop& loop, std::string command, sz_t maxBatch, std::chrono::milliseconds window, int priority)
+: ap(ap),
+  windowTimer(loop.timer(true)),
+  command(std::move(command)),
+  maxBatch(std::max<sz_t>(maxBatch, 1)),
+  window(window),
+  priority(priority) { }
+
+template<typename... Ts>
+AsyncPostgresBatcher<Ts...>::~AsyncPostgresBatcher() {
+	flush();
+}
+
+template<typename... Ts>
+void AsyncPostgresBatcher<Ts...>::add(std::function<void(ResultPtr, sz_t)> cb, Ts... params) {
+	if (!current) {
+		current = ll::make_shared<Batch>();
+	}
+
+	auto b = current; // push can flush the batch
+	sz_t i = push(std::move(params)...);
+	b->entries[i].cb = std::move(cb);
+}
+
+template<typename... Ts>
+typename AsyncPostgresBatcher<Ts...>::Awaiter AsyncPostgresBatcher<Ts...>::add(Ts... params) {
+	if (!current) {
+		current = ll::make_shared<Batch>();
+	}
+
+	auto b = current;
+	sz_t i = push(std::move(params)...);
+	return {std::move(b), i};
+}
+
+template<typename... Ts>
+sz_t AsyncPostgresBatcher<Ts...>::push(Ts&&... params) {
+	Batch& b = *current;
+	std::apply([&] (auto&... cols) {
+		(cols.push_back(std::move(params)), ...);
+	}, b.columns);
+
+	b.entries.emplace_back();
+	sz_t i = b.entries.size() - 1;
+
+	if (b.entries.size() >= maxBatch) {
+		flush();
+	} else if (b.entries.size() == 1) {
+		windowTimer->start([this] (nev::Timer&) {
+			flush();
+		}, window.count());
+	}
+
+	return i;
+}
+
+template<typename... Ts>
+void AsyncPostgresBatcher<Ts...>::flush() {
+	if (!current) {
+		return;
+	}
+
+	windowTimer->stop();
+	auto b = std::exchange(current, nullptr);
+	auto q = std::apply([&] (const auto&... cols) {
+		return ap.query(priority, command, AsyncPostgres::Array<Ts>(cols)...);
+	}, b->columns);
+
+	b->columns = {}; // already copied into the query
+	q->then([b] (AsyncPostgres::Result r) {
+		b->complete(std::move(r));
+	});
+}
+
+template<typename... Ts>
+sz_t AsyncPostgresBatcher<Ts...>::pending() const {
+	return current ? current->entries.size() : 0;
+}
+
+template<typename... Ts>
+AsyncPostgresBatcher<Ts...>::Awaiter::Awaiter(ll::shared_ptr<Batch> b, sz_t i)
+: batch(std::move(b)),
+  index(i) { }
+
+template<typename... Ts>
+bool AsyncPostgresBatcher<Ts...>::Awaiter::await_ready() const noexcept {
+	return !!batch->res;
+}
+
+template<typename... Ts>
+void AsyncPostgresBatcher<Ts...>::Awaiter::await_suspend(std::coroutine_handle<> h) {
+	batch->entries[index].coro = std::move(h);
+}
+
+template<typename... Ts>
+std::pair<typename AsyncPostgresBatcher<Ts...>::ResultPtr, sz_t> AsyncPostgresBatcher<Ts...>::Awaiter::await_resume() {
+	if (!batch->res->success()) {
+		batch->res->throwStatus();
+	}
+
+	return {batch->res, index};
+}
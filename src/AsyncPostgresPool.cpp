@@ -0,0 +1,150 @@
+#include "AsyncPostgresPool.hpp"
+
+#include <stdexcept>
+#include <utility>
+
+AsyncPostgresPool::AsyncPostgresPool(nev::Loop& loop, TimedCallbacks& tc, sz_t numConnections)
+: connChangeFunc(nullptr),
+  nextConn(0) {
+	if (numConnections < 1) {
+		numConnections = 1;
+	}
+
+	for (sz_t i = 0; i < numConnections; i++) {
+		auto& ap = conns.emplace_back(std::make_unique<AsyncPostgres>(loop, tc));
+		ap->onConnectionStateChange([this, i] (ConnStatusType s) {
+			if (s != CONNECTION_OK) {
+				rerouteQueued(i);
+			}
+
+			if (connChangeFunc) {
+				connChangeFunc(i, s);
+			}
+		});
+	}
+}
+
+void AsyncPostgresPool::connect(std::unordered_map<std::string, std::string> connParams, bool expandDbname) {
+	// each connection reconnects on its own if it fails
+	for (auto& ap : conns) {
+		ap->connect(connParams, expandDbname);
+	}
+}
+
+void AsyncPostgresPool::lazyDisconnect() {
+	for (auto& ap : conns) {
+		ap->lazyDisconnect();
+	}
+}
+
+void AsyncPostgresPool::disconnect() {
+	for (auto& ap : conns) {
+		ap->disconnect();
+	}
+}
+
+void AsyncPostgresPool::setAutoReconnect(bool state) {
+	for (auto& ap : conns) {
+		ap->setAutoReconnect(state);
+	}
+}
+
+void AsyncPostgresPool::setDebugPrinting(bool state) {
+	for (auto& ap : conns) {
+		ap->setDebugPrinting(state);
+	}
+}
+
+void AsyncPostgresPool::setPipelineDepth(sz_t depth) {
+	for (auto& ap : conns) {
+		ap->setPipelineDepth(depth);
+	}
+}
+
+bool AsyncPostgresPool::cancelQuery(AsyncPostgres::Query& q) {
+	return q.getConnection().cancelQuery(q);
+}
+
+sz_t AsyncPostgresPool::size() const {
+	return conns.size();
+}
+
+sz_t AsyncPostgresPool::connectedCount() const {
+	sz_t n = 0;
+	for (const auto& ap : conns) {
+		n += ap->isConnected();
+	}
+
+	return n;
+}
+
+sz_t AsyncPostgresPool::queuedQueries() const {
+	sz_t n = 0;
+	for (const auto& ap : conns) {
+		n += ap->queuedQueries();
+	}
+
+	return n;
+}
+
+AsyncPostgres& AsyncPostgresPool::get(sz_t i) {
+	if (i >= conns.size()) {
+		throw std::out_of_range("AsyncPostgresPool::get(): index out of range");
+	}
+
+	return *conns[i];
+}
+
+AsyncPostgres& AsyncPostgresPool::pickConnection(int priority) {
+	return pick(priority);
+}
+
+AsyncPostgres& AsyncPostgresPool::notificationConnection() {
+	return *conns.front();
+}
+
+void AsyncPostgresPool::onConnectionStateChange(std::function<void(sz_t, ConnStatusType)> f) {
+	connChangeFunc = std::move(f);
+}
+
+void AsyncPostgresPool::onNotification(std::function<void(AsyncPostgres::Notification)> f) {
+	notificationConnection().onNotification(std::move(f));
+}
+
+AsyncPostgres::Subscription AsyncPostgresPool::subscribe(std::string channel, std::function<void(const AsyncPostgres::Notification&)> f) {
+	return notificationConnection().subscribe(std::move(channel), std::move(f));
+}
+
+AsyncPostgres& AsyncPostgresPool::pick(int priority) {
+	// the connection that would send a query of this priority the soonest.
+	// disconnected ones are only used if none are up, queries wait there until one connects
+	AsyncPostgres* best = nullptr;
+	bool bestConnected = false;
+	sz_t bestAhead = 0;
+
+	for (sz_t n = 0; n < conns.size(); n++) {
+		AsyncPostgres& ap = *conns[(nextConn + n) % conns.size()];
+		bool connected = ap.isConnected();
+		if (best && bestConnected && !connected) {
+			continue;
+		}
+
+		sz_t ahead = ap.queriesAhead(priority);
+		if (!best || (connected && !bestConnected) || ahead < bestAhead) {
+			best = &ap;
+			bestConnected = connected;
+			bestAhead = ahead;
+		}
+	}
+
+	nextConn = (nextConn + 1) % conns.size();
+	return *best;
+}
+
+void AsyncPostgresPool::rerouteQueued(sz_t i) {
+	// the other connections take over its queue. if none of them are up either, the queries stay
+	AsyncPostgres& to = pick(0);
+	if (&to != conns[i].get() && to.isConnected()) {
+		conns[i]->moveQueuedQueriesTo(to);
+	}
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stop_token>
+
+#include "AsyncPostgres.hpp"
+#include "TimedCallbacks.hpp"
+#include "explints.hpp"
+#include "shared_ptr_ll.hpp"
+#include "Poll.hpp"
+
+// spreads queries over several connections to the same database. queries still queued on a connection that
+// drops are moved to the others, if any is up.
+// the first connection is the designated one for LISTEN queries and notifications.
+// every query() call picks a connection on its own, so a transaction issued as separate queries
+// (BEGIN, ..., COMMIT) could have its statements run on different connections, outside of the transaction.
+// send those through a single connection from pickConnection() instead.
+class AsyncPostgresPool {
+	std::vector<std::unique_ptr<AsyncPostgres>> conns;
+	std::function<void(sz_t, ConnStatusType)> connChangeFunc;
+	sz_t nextConn; // rotates to break ties between equally busy connections
+
+public:
+	AsyncPostgresPool(nev::Loop&, TimedCallbacks&, sz_t numConnections);
+
+	AsyncPostgresPool(const AsyncPostgresPool&) = delete;
+	const AsyncPostgresPool& operator=(const AsyncPostgresPool&) = delete;
+
+	void connect(std::unordered_map<std::string, std::string> connParams = {}, bool expandDbname = false);
+	void lazyDisconnect();
+	void disconnect();
+
+	void setAutoReconnect(bool);
+	void setDebugPrinting(bool);
+	void setPipelineDepth(sz_t);
+
+	template<typename... Ts>
+	ll::shared_ptr<AsyncPostgres::Query> query(int priority, std::stop_token, std::string, Ts&&...);
+
+	template<typename... Ts>
+	ll::shared_ptr<AsyncPostgres::Query> query(int priority, std::string, Ts&&...);
+
+	template<typename... Ts>
+	ll::shared_ptr<AsyncPostgres::Query> query(std::stop_token, std::string, Ts&&...);
+
+	template<typename... Ts>
+	ll::shared_ptr<AsyncPostgres::Query> query(std::string, Ts&&...);
+
+	template<typename... Ts>
+	ll::shared_ptr<AsyncPostgres::Query> query(const char*, Ts&&...);
+
+	// cancels through the connection the query was sent to, see AsyncPostgres::cancelQuery()
+	bool cancelQuery(AsyncPostgres::Query&);
+
+	sz_t size() const;
+	sz_t connectedCount() const;
+	sz_t queuedQueries() const;
+	AsyncPostgres& get(sz_t);
+	AsyncPostgres& pickConnection(int priority = 0); // the one query() would use, to run several queries on
+	AsyncPostgres& notificationConnection(); // LISTEN/UNLISTEN must be sent through this one
+
+	// called with the index of the connection that changed state
+	void onConnectionStateChange(std::function<void(sz_t, ConnStatusType)>);
+	void onNotification(std::function<void(AsyncPostgres::Notification)>);
+	[[nodiscard]] AsyncPostgres::Subscription subscribe(std::string channel, std::function<void(const AsyncPostgres::Notification&)>);
+
+private:
+	AsyncPostgres& pick(int priority);
+	void rerouteQueued(sz_t);
+};
+
+#include "AsyncPostgresPool.tpp" // IWYU pragma: keep
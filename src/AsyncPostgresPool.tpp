@@ -0,0 +1,29 @@
+#pragma once
+#include "AsyncPostgresPool.hpp"
+
+#include <utility>
+
+template<typename... Ts>
+ll::shared_ptr<AsyncPostgres::Query> AsyncPostgresPool::query(int priority, std::stop_token st, std::string command, Ts&&... params) {
+	return pick(priority).query(priority, std::move(st), std::move(command), std::forward<Ts>(params)...);
+}
+
+template<typename... Ts>
+ll::shared_ptr<AsyncPostgres::Query> AsyncPostgresPool::query(int prio, std::string command, Ts&&... params) {
+	return query(prio, std::stop_token{}, std::move(command), std::forward<Ts>(params)...);
+}
+
+template<typename... Ts>
+ll::shared_ptr<AsyncPostgres::Query> AsyncPostgresPool::query(std::stop_token st, std::string command, Ts&&... params) {
+	return query(0, std::move(st), std::move(command), std::forward<Ts>(params)...);
+}
+
+template<typename... Ts>
+ll::shared_ptr<AsyncPostgres::Query> AsyncPostgresPool::query(std::string command, Ts&&... params) {
+	return query(0, std::stop_token{}, std::move(command), std::forward<Ts>(params)...);
+}
+
+template<typename... Ts>
+ll::shared_ptr<AsyncPostgres::Query> AsyncPostgresPool::query(const char* command, Ts&&... params) {
+	return query(0, std::stop_token{}, std::string{command}, std::forward<Ts>(params)...);
+}
@@ -0,0 +1,241 @@
+#include "AsyncPostgresRouter.hpp"
+
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+
+using namespace std::chrono_literals;
+
+AsyncPostgresRouter::AsyncPostgresRouter(nev::Loop& loop, TimedCallbacks& tc)
+: loop(loop),
+  tc(tc),
+  primary(std::make_unique<AsyncPostgres>(loop, tc)),
+  connChangeFunc(nullptr),
+  maxLag(5s),
+  lagCheckInterval(1s),
+  nextReplica(0) {
+	primary->onConnectionStateChange([this] (ConnStatusType s) {
+		if (connChangeFunc) {
+			connChangeFunc(std::nullopt, s);
+		}
+	});
+}
+
+AsyncPostgresRouter::~AsyncPostgresRouter() {
+	// queries are destroyed along with the connections, and lag check callbacks access the replica list
+	lagTimer = nullptr;
+	for (auto& r : replicas) {
+		r.conn.reset();
+	}
+}
+
+void AsyncPostgresRouter::connect(std::unordered_map<std::string, std::string> primaryParams,
+		std::vector<std::unordered_map<std::string, std::string>> replicaParams, bool expandDbname) {
+	if (replicas.empty()) {
+		replicas.reserve(replicaParams.size());
+		for (sz_t i = 0; i < replicaParams.size(); i++) {
+			auto& r = replicas.emplace_back(Replica{std::make_unique<AsyncPostgres>(loop, tc), 0ms, false, false, 0});
+			r.conn->setAutoReconnect(primary->isAutoReconnectEnabled());
+			r.conn->onConnectionStateChange([this, i] (ConnStatusType s) {
+				// lag is unknown until checked again on the new connection
+				replicas[i].lagKnown = false;
+				if (s == CONNECTION_OK) {
+					checkLag(i);
+				} else {
+					rerouteQueued(i);
+				}
+
+				if (connChangeFunc) {
+					connChangeFunc(i, s);
+				}
+			});
+		}
+	}
+
+	primary->connect(std::move(primaryParams), expandDbname);
+	for (sz_t i = 0; i < replicas.size() && i < replicaParams.size(); i++) {
+		replicas[i].conn->connect(std::move(replicaParams[i]), expandDbname);
+	}
+
+	if (!lagTimer && !replicas.empty()) {
+		lagTimer = tc.timer([this] {
+			checkLag();
+			return true;
+		}, lagCheckInterval);
+	}
+}
+
+void AsyncPostgresRouter::lazyDisconnect() {
+	lagTimer = nullptr;
+	primary->lazyDisconnect();
+	for (auto& r : replicas) {
+		r.conn->lazyDisconnect();
+	}
+}
+
+void AsyncPostgresRouter::disconnect() {
+	lagTimer = nullptr;
+	primary->disconnect();
+	for (auto& r : replicas) {
+		r.conn->disconnect();
+	}
+}
+
+void AsyncPostgresRouter::setAutoReconnect(bool state) {
+	primary->setAutoReconnect(state);
+	for (auto& r : replicas) {
+		r.conn->setAutoReconnect(state);
+	}
+}
+
+void AsyncPostgresRouter::setDebugPrinting(bool state) {
+	primary->setDebugPrinting(state);
+	for (auto& r : replicas) {
+		r.conn->setDebugPrinting(state);
+	}
+}
+
+void AsyncPostgresRouter::setMaxReplicaLag(std::chrono::milliseconds lag) {
+	maxLag = lag;
+}
+
+void AsyncPostgresRouter::setLagCheckInterval(std::chrono::milliseconds interval) {
+	lagCheckInterval = interval;
+	if (lagTimer) {
+		lagTimer.start(interval);
+	}
+}
+
+AsyncPostgres& AsyncPostgresRouter::getPrimary() {
+	return *primary;
+}
+
+AsyncPostgres& AsyncPostgresRouter::getReplica(sz_t i) {
+	if (i >= replicas.size()) {
+		throw std::out_of_range("AsyncPostgresRouter::getReplica(): index out of range");
+	}
+
+	return *replicas[i].conn;
+}
+
+sz_t AsyncPostgresRouter::replicaCount() const {
+	return replicas.size();
+}
+
+sz_t AsyncPostgresRouter::usableReplicaCount() const {
+	sz_t n = 0;
+	for (const auto& r : replicas) {
+		n += isUsable(r);
+	}
+
+	return n;
+}
+
+std::optional<std::chrono::milliseconds> AsyncPostgresRouter::replicaLag(sz_t i) const {
+	if (i >= replicas.size() || !replicas[i].lagKnown) {
+		return std::nullopt;
+	}
+
+	return replicas[i].lag;
+}
+
+void AsyncPostgresRouter::onConnectionStateChange(std::function<void(std::optional<sz_t>, ConnStatusType)> f) {
+	connChangeFunc = std::move(f);
+}
+
+void AsyncPostgresRouter::onNotification(std::function<void(AsyncPostgres::Notification)> f) {
+	primary->onNotification(std::move(f));
+}
+
+AsyncPostgres::Subscription AsyncPostgresRouter::subscribe(std::string channel, std::function<void(const AsyncPostgres::Notification&)> f) {
+	return primary->subscribe(std::move(channel), std::move(f));
+}
+
+bool AsyncPostgresRouter::isUsable(const Replica& r) const {
+	return r.conn && r.conn->isConnected() && r.lagKnown && r.lag <= maxLag;
+}
+
+AsyncPostgres& AsyncPostgresRouter::pickReader(int priority) {
+	Replica* best = nullptr;
+	sz_t bestAhead = 0;
+
+	for (sz_t n = 0; n < replicas.size(); n++) {
+		Replica& r = replicas[(nextReplica + n) % replicas.size()];
+		if (!isUsable(r)) {
+			continue;
+		}
+
+		sz_t ahead = r.conn->queriesAhead(priority);
+		if (!best || ahead < bestAhead) {
+			best = &r;
+			bestAhead = ahead;
+		}
+	}
+
+	if (!replicas.empty()) {
+		nextReplica = (nextReplica + 1) % replicas.size();
+	}
+
+	return best ? *best->conn : *primary;
+}
+
+void AsyncPostgresRouter::rerouteQueued(sz_t i) {
+	// reads shouldn't wait for the replica to come back. if nothing else is connected either, they stay
+	AsyncPostgres& to = pickReader(0);
+	if (&to != replicas[i].conn.get() && to.isConnected()) {
+		replicas[i].conn->moveQueuedQueriesTo(to);
+	}
+}
+
+void AsyncPostgresRouter::checkLag() {
+	for (sz_t i = 0; i < replicas.size(); i++) {
+		checkLag(i);
+	}
+}
+
+void AsyncPostgresRouter::checkLag(sz_t i) {
+	Replica& r = replicas[i];
+	if (r.checking || !r.conn->isConnected()) {
+		return;
+	}
+
+	// the last replay timestamp doesn't advance while the primary is idle, so it only counts if there's WAL left to replay.
+	// that's only true while WAL is being received, a replica cut off from the primary has nothing left to replay
+	// either, so its lag is unknown (null). the receiver's status is null without pg_read_all_stats, then it's
+	// trusted to be streaming if it's running at all
+	auto q = r.conn->query(std::numeric_limits<int>::max(),
+		"SELECT CASE WHEN NOT pg_is_in_recovery() THEN 0 "
+		"WHEN NOT EXISTS (SELECT 1 FROM pg_stat_wal_receiver WHERE coalesce(status, 'streaming') = 'streaming') THEN NULL "
+		"WHEN pg_last_wal_receive_lsn() = pg_last_wal_replay_lsn() THEN 0 "
+		"ELSE (EXTRACT(EPOCH FROM now() - pg_last_xact_replay_timestamp()) * 1000)::int8 END");
+
+	r.checking = true;
+	q->pin(); // the result is about this replica
+	q->setTimeout(std::max(lagCheckInterval, 1000ms));
+	q->then([this, i] (AsyncPostgres::Result res) {
+		Replica& r = replicas[i];
+		r.checking = false;
+		if (!res || res.size() == 0) {
+			r.lagKnown = false;
+			if (++r.failedChecks == 3) {
+				std::cerr << "[AsyncPostgresRouter/checkLag()]: Replica " << i << " failed 3 lag checks in a row: "
+					<< res.getErrorMessage() << std::endl;
+			}
+
+			return;
+		}
+
+		r.failedChecks = 0;
+		auto [lag] = res[0].get<std::optional<i64>>();
+		if (!lag) {
+			// not streaming, or nothing replayed yet. unusable until a real measurement arrives
+			r.lagKnown = false;
+			return;
+		}
+
+		r.lag = std::chrono::milliseconds(std::max<i64>(*lag, 0));
+		r.lagKnown = true;
+	});
+}
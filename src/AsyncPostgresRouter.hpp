@@ -0,0 +1,110 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stop_token>
+
+#include "AsyncPostgres.hpp"
+#include "TimedCallbacks.hpp"
+#include "explints.hpp"
+#include "shared_ptr_ll.hpp"
+#include "Poll.hpp"
+
+// sends writes to a primary server, and read-only queries to its replicas. replicas are only used while
+// connected and within the max replication lag, which is checked periodically. a replica that isn't streaming
+// WAL from the primary has an unknown lag, and isn't used. reads fall back to the primary if no replica is
+// usable. reads still queued on a replica that disconnects are moved to another connection
+class AsyncPostgresRouter {
+	struct Replica {
+		std::unique_ptr<AsyncPostgres> conn;
+		std::chrono::milliseconds lag;
+		bool lagKnown; // a lag check succeeded since the last (re)connection
+		bool checking;
+		u32 failedChecks; // in a row
+	};
+
+	nev::Loop& loop;
+	TimedCallbacks& tc;
+	TimedCallbacks::TimerToken lagTimer;
+	std::unique_ptr<AsyncPostgres> primary;
+	std::vector<Replica> replicas;
+	std::function<void(std::optional<sz_t>, ConnStatusType)> connChangeFunc;
+	std::chrono::milliseconds maxLag;
+	std::chrono::milliseconds lagCheckInterval;
+	sz_t nextReplica; // rotates to break ties between equally busy replicas
+
+public:
+	AsyncPostgresRouter(nev::Loop&, TimedCallbacks&);
+	~AsyncPostgresRouter();
+
+	AsyncPostgresRouter(const AsyncPostgresRouter&) = delete;
+	const AsyncPostgresRouter& operator=(const AsyncPostgresRouter&) = delete;
+
+	// replicas are only added the first time this is called
+	void connect(std::unordered_map<std::string, std::string> primaryParams,
+		std::vector<std::unordered_map<std::string, std::string>> replicaParams, bool expandDbname = false);
+	void lazyDisconnect();
+	void disconnect();
+
+	void setAutoReconnect(bool);
+	void setDebugPrinting(bool);
+	void setMaxReplicaLag(std::chrono::milliseconds);
+	void setLagCheckInterval(std::chrono::milliseconds);
+
+	// sent to the primary
+	template<typename... Ts>
+	ll::shared_ptr<AsyncPostgres::Query> query(int priority, std::stop_token, std::string, Ts&&...);
+
+	template<typename... Ts>
+	ll::shared_ptr<AsyncPostgres::Query> query(int priority, std::string, Ts&&...);
+
+	template<typename... Ts>
+	ll::shared_ptr<AsyncPostgres::Query> query(std::stop_token, std::string, Ts&&...);
+
+	template<typename... Ts>
+	ll::shared_ptr<AsyncPostgres::Query> query(std::string, Ts&&...);
+
+	template<typename... Ts>
+	ll::shared_ptr<AsyncPostgres::Query> query(const char*, Ts&&...);
+
+	// sent to the least busy usable replica, or the primary if there are none
+	template<typename... Ts>
+	ll::shared_ptr<AsyncPostgres::Query> readQuery(int priority, std::stop_token, std::string, Ts&&...);
+
+	template<typename... Ts>
+	ll::shared_ptr<AsyncPostgres::Query> readQuery(int priority, std::string, Ts&&...);
+
+	template<typename... Ts>
+	ll::shared_ptr<AsyncPostgres::Query> readQuery(std::stop_token, std::string, Ts&&...);
+
+	template<typename... Ts>
+	ll::shared_ptr<AsyncPostgres::Query> readQuery(std::string, Ts&&...);
+
+	template<typename... Ts>
+	ll::shared_ptr<AsyncPostgres::Query> readQuery(const char*, Ts&&...);
+
+	AsyncPostgres& getPrimary();
+	AsyncPostgres& getReplica(sz_t);
+	sz_t replicaCount() const;
+	sz_t usableReplicaCount() const;
+	std::optional<std::chrono::milliseconds> replicaLag(sz_t) const; // empty if unknown
+
+	// called with the index of the replica that changed state, or empty for the primary
+	void onConnectionStateChange(std::function<void(std::optional<sz_t>, ConnStatusType)>);
+	void onNotification(std::function<void(AsyncPostgres::Notification)>);
+	[[nodiscard]] AsyncPostgres::Subscription subscribe(std::string channel, std::function<void(const AsyncPostgres::Notification&)>);
+
+private:
+	bool isUsable(const Replica&) const;
+	AsyncPostgres& pickReader(int priority);
+	void rerouteQueued(sz_t replica);
+	void checkLag();
+	void checkLag(sz_t);
+};
+
+#include "AsyncPostgresRouter.tpp" // IWYU pragma: keep
@@ -0,0 +1,54 @@
+#pragma once
+#include "AsyncPostgresRouter.hpp"
+
+#include <utility>
+
+template<typename... Ts>
+ll::shared_ptr<AsyncPostgres::Query> AsyncPostgresRouter::query(int priority, std::stop_token st, std::string command, Ts&&... params) {
+	return primary->query(priority, std::move(st), std::move(command), std::forward<Ts>(params)...);
+}
+
+template<typename... Ts>
+ll::shared_ptr<AsyncPostgres::Query> AsyncPostgresRouter::query(int prio, std::string command, Ts&&... params) {
+	return query(prio, std::stop_token{}, std::move(command), std::forward<Ts>(params)...);
+}
+
+template<typename... Ts>
+ll::shared_ptr<AsyncPostgres::Query> AsyncPostgresRouter::query(std::stop_token st, std::string command, Ts&&... params) {
+	return query(0, std::move(st), std::move(command), std::forward<Ts>(params)...);
+}
+
+template<typename... Ts>
+ll::shared_ptr<AsyncPostgres::Query> AsyncPostgresRouter::query(std::string command, Ts&&... params) {
+	return query(0, std::stop_token{}, std::move(command), std::forward<Ts>(params)...);
+}
+
+template<typename... Ts>
+ll::shared_ptr<AsyncPostgres::Query> AsyncPostgresRouter::query(const char* command, Ts&&... params) {
+	return query(0, std::stop_token{}, std::string{command}, std::forward<Ts>(params)...);
+}
+
+template<typename... Ts>
+ll::shared_ptr<AsyncPostgres::Query> AsyncPostgresRouter::readQuery(int priority, std::stop_token st, std::string command, Ts&&... params) {
+	return pickReader(priority).query(priority, std::move(st), std::move(command), std::forward<Ts>(params)...);
+}
+
+template<typename... Ts>
+ll::shared_ptr<AsyncPostgres::Query> AsyncPostgresRouter::readQuery(int prio, std::string command, Ts&&... params) {
+	return readQuery(prio, std::stop_token{}, std::move(command), std::forward<Ts>(params)...);
+}
+
+template<typename... Ts>
+ll::shared_ptr<AsyncPostgres::Query> AsyncPostgresRouter::readQuery(std::stop_token st, std::string command, Ts&&... params) {
+	return readQuery(0, std::move(st), std::move(command), std::forward<Ts>(params)...);
+}
+
+template<typename... Ts>
+ll::shared_ptr<AsyncPostgres::Query> AsyncPostgresRouter::readQuery(std::string command, Ts&&... params) {
+	return readQuery(0, std::stop_token{}, std::move(command), std::forward<Ts>(params)...);
+}
+
+template<typename... Ts>
+ll::shared_ptr<AsyncPostgres::Query> AsyncPostgresRouter::readQuery(const char* command, Ts&&... params) {
+	return readQuery(0, std::stop_token{}, std::string{command}, std::forward<Ts>(params)...);
+}
@@ -0,0 +1,65 @@
+#include "Histogram.hpp"
+
+#include <algorithm>
+#include <bit>
+
+Histogram::Histogram()
+: buckets{},
+  count(0),
+  sum(0),
+  max(0) { }
+
+void Histogram::add(u64 value) {
+	++buckets[std::bit_width(value)];
+	++count;
+	sum += value;
+	max = std::max(max, value);
+}
+
+void Histogram::merge(const Histogram& h) {
+	for (sz_t i = 0; i < buckets.size(); i++) {
+		buckets[i] += h.buckets[i];
+	}
+
+	count += h.count;
+	sum += h.sum;
+	max = std::max(max, h.max);
+}
+
+void Histogram::reset() {
+	*this = Histogram{};
+}
+
+u64 Histogram::getCount() const {
+	return count;
+}
+
+u64 Histogram::getSum() const {
+	return sum;
+}
+
+u64 Histogram::getMax() const {
+	return max;
+}
+
+double Histogram::getMean() const {
+	return count == 0 ? 0.0 : static_cast<double>(sum) / count;
+}
+
+u64 Histogram::getPercentile(double p) const {
+	u64 target = static_cast<u64>(std::clamp(p, 0.0, 1.0) * count);
+	u64 seen = 0;
+	for (sz_t i = 0; i < buckets.size(); i++) {
+		seen += buckets[i];
+		if (seen > target || (seen == count && seen != 0)) {
+			u64 upper = i == 0 ? 0 : i == 64 ? max : (u64(1) << i) - 1;
+			return std::min(upper, max);
+		}
+	}
+
+	return 0;
+}
+
+const Histogram::Buckets& Histogram::getBuckets() const {
+	return buckets;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <array>
+
+#include "explints.hpp"
+
+// log2-bucketed histogram. bucket 0 counts zeroes, bucket i counts values in [2^(i-1), 2^i)
+class Histogram {
+public:
+	using Buckets = std::array<u64, 65>;
+
+private:
+	Buckets buckets;
+	u64 count;
+	u64 sum;
+	u64 max;
+
+public:
+	Histogram();
+
+	void add(u64);
+	void merge(const Histogram&);
+	void reset();
+
+	u64 getCount() const;
+	u64 getSum() const;
+	u64 getMax() const;
+	double getMean() const;
+	// upper bound of the bucket the percentile (0-1) falls in, clamped to the max value seen
+	u64 getPercentile(double) const;
+	const Buckets& getBuckets() const;
+};
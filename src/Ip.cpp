@@ -148,6 +148,23 @@ Ip Ip::fromBytes(std::string_view bytes) {
 	return fromBytes(bytes.data(), bytes.size());
 }
 
+Ip Ip::fromPgData(const char * c, sz_t s) {
+	// family, mask, is_cidr, addr size, addr data...
+	if (s < 4 || static_cast<u8>(c[3]) + 4u != s) {
+		throw std::invalid_argument("Invalid inet data");
+	}
+
+	std::array<u8, 16> arr{0};
+	if (c[3] == 4) {
+		arr[10] = arr[11] = 0xFF; // ipv4 mapped
+	} else if (c[3] != 16) {
+		throw std::invalid_argument("Invalid inet address size");
+	}
+
+	std::copy_n(reinterpret_cast<const u8 *>(c + 4), static_cast<u8>(c[3]), arr.end() - c[3]);
+	return Ip(arr);
+}
+
 
 bool Ip::operator ==(const Ip& b) const {
 	return address == b.address;
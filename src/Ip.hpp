@@ -30,6 +30,7 @@ public:
 	static Ip fromString(const char *, sz_t);
 	static Ip fromBytes(const char *, sz_t);
 	static Ip fromBytes(std::string_view);
+	static Ip fromPgData(const char *, sz_t); // binary inet/cidr format, as made by getPgData()
 
 	bool operator ==(const Ip&) const;
 	bool operator  <(const Ip&) const;
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <atomic>
+
+struct MpscNode {
+	std::atomic<MpscNode *> mpscNext{nullptr};
+};
+
+// intrusive lock-free multi producer, single consumer queue (Vyukov's). T must derive
+// from MpscNode, nodes aren't owned by the queue and must stay alive until popped
+template<typename T>
+class MpscQueue {
+	std::atomic<MpscNode *> head; // most recently pushed
+	MpscNode * tail; // next to pop, only touched by the consumer
+	MpscNode stub;
+
+public:
+	MpscQueue();
+
+	MpscQueue(const MpscQueue&) = delete;
+	const MpscQueue& operator=(const MpscQueue&) = delete;
+
+	void push(T *); // thread safe
+	// consumer thread only. returns null when empty, or if the next push is still in progress,
+	// so producers should notify the consumer after pushing
+	T * pop();
+
+private:
+	void pushNode(MpscNode *);
+};
+
+#include "MpscQueue.tpp" // IWYU pragma: keep
@@ -0,0 +1,53 @@
+#include "MpscQueue.hpp"
+
+template<typename T>
+MpscQueue<T>::MpscQueue()
+: head(&stub),
+  tail(&stub) { }
+
+template<typename T>
+void MpscQueue<T>::push(T * n) {
+	pushNode(n);
+}
+
+template<typename T>
+T * MpscQueue<T>::pop() {
+	MpscNode * t = tail;
+	MpscNode * next = t->mpscNext.load(std::memory_order_acquire);
+
+	if (t == &stub) {
+		if (!next) {
+			return nullptr;
+		}
+
+		tail = next;
+		t = next;
+		next = next->mpscNext.load(std::memory_order_acquire);
+	}
+
+	if (next) {
+		tail = next;
+		return static_cast<T *>(t);
+	}
+
+	if (t != head.load(std::memory_order_acquire)) {
+		return nullptr; // a producer swapped head but didn't link it yet
+	}
+
+	// t is the last node, the stub has to go after it before t can be taken
+	pushNode(&stub);
+	next = t->mpscNext.load(std::memory_order_acquire);
+	if (next) {
+		tail = next;
+		return static_cast<T *>(t);
+	}
+
+	return nullptr;
+}
+
+template<typename T>
+void MpscQueue<T>::pushNode(MpscNode * n) {
+	n->mpscNext.store(nullptr, std::memory_order_relaxed);
+	MpscNode * prev = head.exchange(n, std::memory_order_acq_rel);
+	prev->mpscNext.store(n, std::memory_order_release);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+#include "explints.hpp"
+
+// keeps freed single objects of a type around for reuse, to avoid hitting malloc for frequently
+// recreated objects. the free lists are per thread, a block freed by another thread than the one that
+// allocated it just moves to that thread's list. objects can outlive their thread's list (e.g. globals
+// destroyed after thread_locals), the list isn't used anymore once it's gone
+template<typename T>
+class PoolAllocator {
+	static constexpr sz_t maxCached = 256;
+
+	struct FreeList {
+		std::vector<void *> blocks;
+
+		~FreeList();
+	};
+
+	static thread_local FreeList freeList;
+	static thread_local bool freeListGone; // trivially destructible, so it can be read after freeList's destructor ran
+
+public:
+	using value_type = T;
+
+	PoolAllocator() noexcept = default;
+
+	template<typename U>
+	PoolAllocator(const PoolAllocator<U>&) noexcept { }
+
+	T * allocate(sz_t n);
+	void deallocate(T *, sz_t n) noexcept;
+
+	template<typename U>
+	bool operator==(const PoolAllocator<U>&) const noexcept { return true; }
+
+	template<typename U>
+	bool operator!=(const PoolAllocator<U>&) const noexcept { return false; }
+};
+
+#include "PoolAllocator.tpp" // IWYU pragma: keep
@@ -0,0 +1,40 @@
+#pragma once
+#include "PoolAllocator.hpp"
+
+template<typename T>
+thread_local typename PoolAllocator<T>::FreeList PoolAllocator<T>::freeList;
+
+template<typename T>
+thread_local bool PoolAllocator<T>::freeListGone = false;
+
+template<typename T>
+PoolAllocator<T>::FreeList::~FreeList() {
+	freeListGone = true;
+	for (void * p : blocks) {
+		::operator delete(p);
+	}
+}
+
+template<typename T>
+T * PoolAllocator<T>::allocate(sz_t n) {
+	static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__, "Over-aligned types not supported");
+	if (n == 1 && !freeListGone && !freeList.blocks.empty()) {
+		void * p = freeList.blocks.back();
+		freeList.blocks.pop_back();
+		return static_cast<T *>(p);
+	}
+
+	return static_cast<T *>(::operator new(n * sizeof(T)));
+}
+
+template<typename T>
+void PoolAllocator<T>::deallocate(T * p, sz_t n) noexcept {
+	if (n == 1 && !freeListGone && freeList.blocks.size() < maxCached) {
+		try {
+			freeList.blocks.push_back(p);
+			return;
+		} catch (const std::bad_alloc&) { }
+	}
+
+	::operator delete(p);
+}
@@ -13,11 +13,14 @@ RecaptchaRestApi::RecaptchaRestApi(AsyncCurl& ac, std::vector<std::string> allow
   allowedHostnames(std::move(allowedHostnames)) { }
 
 void RecaptchaRestApi::check(Ip ip, std::string token, std::function<void(std::optional<bool>, nlohmann::json)> cb) {
-	ac.httpGet("https://www.google.com/recaptcha/api/siteverify", {
+	AsyncCurl::Request req("https://www.google.com/recaptcha/api/siteverify");
+	req.setFormBody({
 		{"secret", apiKey},
 		{"remoteip", ip.toString().data()}, // XXX: fix when json lib supports string views
-		{"response", std::move(token)}
-	}, [this, end{std::move(cb)}] (auto res) {
+		{"response", token}
+	});
+
+	ac.request(std::move(req), [this, end{std::move(cb)}] (auto res) {
 		if (!res.successful) {
 			/* HTTP ERROR code check */
 			std::cerr << "Error occurred when verifying captcha: " << res.errorString << ", " << res.data << std::endl;
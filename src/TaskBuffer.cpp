@@ -4,44 +4,209 @@
 	#include <pthread.h>
 #endif
 
+#include <algorithm>
 #include <cstring>
 #include <chrono>
 #include <iostream>
 
 #include <explints.hpp>
 
-TaskBuffer::TaskBuffer(nev::Loop& loop, std::size_t numWorkers) {
+/* Double ended queue that keeps its memory, std::deque frees and
+ * allocates blocks as tasks go through it */
+class TaskRing {
+	std::vector<TaskBuffer::Task> slots; // size is a power of two
+	sz_t first = 0;
+	sz_t count = 0;
+
+public:
+	bool empty() const {
+		return count == 0;
+	}
+
+	void pushBack(TaskBuffer::Task t) {
+		if (count == slots.size()) {
+			grow();
+		}
+
+		slots[(first + count++) & (slots.size() - 1)] = std::move(t);
+	}
+
+	TaskBuffer::Task popBack() {
+		return std::move(slots[(first + --count) & (slots.size() - 1)]);
+	}
+
+	TaskBuffer::Task popFront() {
+		TaskBuffer::Task t(std::move(slots[first]));
+		first = (first + 1) & (slots.size() - 1);
+		--count;
+		return t;
+	}
+
+private:
+	void grow() {
+		std::vector<TaskBuffer::Task> bigger(std::max<sz_t>(16, slots.size() * 2));
+		for (sz_t i = 0; i < count; i++) {
+			bigger[i] = std::move(slots[(first + i) & (slots.size() - 1)]);
+		}
+
+		slots.swap(bigger);
+		first = 0;
+	}
+};
+
+struct TaskBuffer::Worker {
+	std::mutex taskLock;
+	/* Expensive functions (run on another thread), the owner takes
+	 * from the back, idle workers steal from the front */
+	std::array<TaskRing, numLanes> tasks;
+	/* Stride scheduling state, only used by this worker's thread */
+	std::array<u64, numLanes> pass{};
+	u64 vtime = 0;
+	std::thread thread;
+};
+
+struct TaskBuffer::ParallelJob {
+	ChunkFn fn;
+	void * ctx;
+	sz_t begin;
+	sz_t end;
+	sz_t chunkSize;
+	sz_t chunks;
+	std::atomic<sz_t> nextChunk;
+	std::atomic<sz_t> unfinished;
+	std::atomic<bool> failed;
+	std::exception_ptr error; /* Set by whoever sets failed */
+	std::coroutine_handle<> waiter; /* Null for blocking calls */
+	std::exception_ptr * errorOut; /* The awaiter's, filled in before resuming */
+
+	/* Returns true if this call finished the last chunk */
+	bool runChunks();
+	void complete();
+};
+
+bool TaskBuffer::ParallelJob::runChunks() {
+	sz_t c;
+	bool last = false;
+	while ((c = nextChunk.fetch_add(1, std::memory_order_relaxed)) < chunks) {
+		if (!failed.load(std::memory_order_relaxed)) {
+			sz_t b = begin + c * chunkSize;
+			try {
+				fn(ctx, b, std::min(b + chunkSize, end));
+			} catch (...) {
+				if (!failed.exchange(true)) {
+					error = std::current_exception();
+				}
+			}
+		}
+
+		last = unfinished.fetch_sub(1, std::memory_order_acq_rel) == 1;
+	}
+
+	return last;
+}
+
+void TaskBuffer::ParallelJob::complete() {
+	if (waiter) {
+		*errorOut = error;
+		waiter.resume();
+	} else {
+		unfinished.notify_all();
+	}
+}
+
+/* Nodes this thread can reuse for runInMainThread(). They aren't tied to
+ * the TaskBuffer they came from, any instance's free list can refill it */
+struct TaskBuffer::MainNodeCache {
+	MainNode * head = nullptr;
+
+	~MainNodeCache() {
+		while (MainNode * n = head) {
+			head = next(n);
+			delete n;
+		}
+	}
+
+	/* mpscNext links the free lists too, unused nodes aren't in the queue */
+	static MainNode * next(MainNode * n) {
+		return static_cast<MainNode *>(n->mpscNext.load(std::memory_order_relaxed));
+	}
+};
+
+/* Lets queue() push to the calling worker's own deque */
+static thread_local struct {
+	TaskBuffer * tb = nullptr;
+	sz_t worker = 0;
+} currentWorker;
+
+static constexpr u64 strideBase = 1 << 16;
+/* Nodes run while more than this many are queued are freed instead,
+ * so a burst doesn't leave huge free lists behind */
+static constexpr sz_t maxRecycledMainNodes = 256;
+
+TaskBuffer::TaskBuffer(nev::Loop& loop, std::size_t numWorkers)
+: shouldRun(true),
+  sleepingWorkers(0),
+  nextWorker(0),
+  mtTaskCount(0),
+  freeMainNodes(nullptr),
+  mtBudget(std::chrono::milliseconds(5)) {
 	execCaller = loop.async([this] (nev::Async&) {
-		executeMainThreadTasks();
+		executeMainThreadTasks(mtBudget);
 	}, true);
 
-	//shouldRun = ATOMIC_FLAG_INIT;
-	shouldRun.clear();
-	shouldRun.test_and_set();
-
 	if (numWorkers < 1) {
 		numWorkers = 1;
 	}
 
+	static constexpr u32 defaultWeights[numLanes] = {8, 4, 1};
+	for (sz_t i = 0; i < numLanes; i++) {
+		lanes[i].queued = 0;
+		lanes[i].running = 0;
+		lanes[i].maxRunning = numWorkers;
+		lanes[i].weight = defaultWeights[i];
+	}
+
+	// leave a worker free for latency sensitive tasks
+	lanes[static_cast<sz_t>(Priority::LOW)].maxRunning = std::max<sz_t>(1, numWorkers - 1);
+
+	// all deques must exist before any worker tries to steal from them
+	for (sz_t i = 0; i < numWorkers; i++) {
+		workers.emplace_back(std::make_unique<Worker>());
+	}
+
 	for (sz_t i = 0; i < numWorkers; i++) {
-		workers.emplace_back([this] { executeTasks(); });
+		workers[i]->thread = std::thread([this, i] { executeTasks(i); });
 	}
 
 	std::cout << workers.size() << " workers created!" << std::endl;
 }
 
 TaskBuffer::~TaskBuffer() {
-	shouldRun.clear();
+	{
+		std::lock_guard<std::mutex> lk(cvLock);
+		shouldRun = false;
+	}
+
 	cv.notify_all();
 	for (auto& worker : workers) {
-		worker.join();
+		worker->thread.join();
+	}
+
+	// coroutines waiting to switch to the main thread are left suspended
+	while (MainNode * n = mtTasks.pop()) {
+		if (n->owned) {
+			delete n;
+		}
 	}
+
+	MainNodeCache leftover; // deletes them
+	leftover.head = freeMainNodes.exchange(nullptr);
 }
 
 void TaskBuffer::prepareForDestruction() {
 	// This function is needed because else the event loop doesn't stop
 	// when the server closes
-	executeMainThreadTasks();
+	executeMainThreadTasks(std::chrono::microseconds::zero());
 	execCaller = nullptr;
 }
 
@@ -49,7 +214,7 @@ void TaskBuffer::setWorkerThreadsSchedulingPriorityToLowestPossibleValueAllowedB
 #ifndef __WIN32
 	sched_param param = { 0 };
 	for (auto& worker : workers) {
-		if (auto ret = pthread_setschedparam(worker.native_handle(), SCHED_IDLE, &param)) {
+		if (auto ret = pthread_setschedparam(worker->thread.native_handle(), SCHED_IDLE, &param)) {
 			std::cerr << "pthread_setschedparam failed (" << ret << "): " << std::strerror(ret) << std::endl;
 		}
 	}
@@ -58,86 +223,410 @@ void TaskBuffer::setWorkerThreadsSchedulingPriorityToLowestPossibleValueAllowedB
 #endif
 }
 
-void TaskBuffer::executeMainThreadTasks() {
-	/* .empty() is not thread safe, but this is the only
-	 * function where items are removed from the queue.
-	 */
-	if (mtTasks.empty()) {
-		return; /* Avoid locking the mutex */
-	}
+void TaskBuffer::executeMainThreadTasks(std::chrono::microseconds budget) {
+	auto start = std::chrono::steady_clock::now();
+	sz_t ran = 0;
 
-	std::vector<std::function<void(TaskBuffer &)>> tasks;
+	while (MainNode * n = mtTasks.pop()) {
+		--mtTaskCount;
+		if (n->owned) {
+			std::unique_ptr<MainNode> owned(n);
+			owned->task(*this);
+			owned->task = Task();
+			recycleMainNode(owned.release());
+		} else {
+			// a coroutine awaiting switchToMain() owns the node, and it may be gone after this
+			n->task(*this);
+		}
 
-	{
-		std::lock_guard<std::mutex> lk(mtTaskLock);
-		tasks.swap(mtTasks);
+		// reading the clock is cheap, but not free
+		if (budget.count() > 0 && ++ran % 16 == 0 && std::chrono::steady_clock::now() - start >= budget) {
+			break;
+		}
 	}
 
-	for (auto& func : tasks) {
-		func(*this);
+	// producers only send() when the count goes up from 0, so if anything is left
+	// (over budget, or a push still in progress) the next iteration has to be requested here
+	if (mtTaskCount > 0 && execCaller) {
+		execCaller->send();
 	}
 }
 
-void TaskBuffer::executeTasks() {
-	std::unique_lock<std::mutex> uLock(cvLock);
-	std::vector<std::function<void(TaskBuffer &)>> tasks;
+void TaskBuffer::executeTasks(std::size_t worker) {
+	currentWorker.tb = this;
+	currentWorker.worker = worker;
+	Task task;
+	sz_t lane = 0;
 
-	do {
-		if (!asyncTasks.empty()) {
-			{
-				std::lock_guard<std::mutex> lk(taskLock);
-				// this takes the whole vector, not just one function, but,
-				// if functions are queuing up this fast the other threads should
-				// be able to get work too while tasks execute
-				// it also dances around the vectors's memory blocks so
-				// no new allocations will be made eventually (faster emplace)
-				tasks.swap(asyncTasks);
+	while (shouldRun) {
+		if (takeTask(worker, task, lane)) {
+			task(*this);
+			task = Task{};
+			--lanes[lane].running;
+			// a worker may be sleeping on a task that was held back by the lane limit
+			if (lanes[lane].queued > 0 && sleepingWorkers > 0) {
+				{ std::lock_guard<std::mutex> lk(cvLock); }
+				cv.notify_one();
 			}
 
-			for (auto& func : tasks) {
-				func(*this);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> uLock(cvLock);
+		// queue() reads sleepingWorkers after incrementing a lane's queued count, and
+		// we check the counts after incrementing this, so a wakeup can't be missed
+		++sleepingWorkers;
+		cv.wait(uLock, [this] { return hasRunnableTask() || !shouldRun; });
+		--sleepingWorkers;
+	}
+}
+
+bool TaskBuffer::takeTask(std::size_t worker, Task& out, std::size_t& lane) {
+	Worker& w = *workers[worker];
+	bool tried[numLanes] = {};
+
+	for (sz_t attempt = 0; attempt < numLanes; attempt++) {
+		// the lane with the lowest pass goes next, lanes that were idle
+		// start from the current time instead of catching up
+		sz_t best = numLanes;
+		u64 bestPass = 0;
+		for (sz_t l = 0; l < numLanes; l++) {
+			if (tried[l] || lanes[l].queued == 0 || lanes[l].running >= lanes[l].maxRunning) {
+				continue;
 			}
 
-			tasks.clear();
-		} else {
-			/* Only wait if the vector is empty */
-			cv.wait_for(uLock, std::chrono::seconds(10));
+			u64 p = std::max(w.pass[l], w.vtime);
+			if (best == numLanes || p < bestPass) {
+				best = l;
+				bestPass = p;
+			}
+		}
+
+		if (best == numLanes) {
+			return false;
+		}
+
+		tried[best] = true;
+		Lane& ln = lanes[best];
+		sz_t running = ln.running;
+		do {
+			if (running >= ln.maxRunning) {
+				break;
+			}
+		} while (!ln.running.compare_exchange_weak(running, running + 1));
+
+		if (running >= ln.maxRunning) {
+			continue;
+		}
+
+		if (takeFromLane(worker, best, out)) {
+			w.vtime = bestPass;
+			w.pass[best] = bestPass + strideBase / std::max<u32>(1, ln.weight);
+			lane = best;
+			return true;
+		}
+
+		--ln.running;
+	}
+
+	return false;
+}
+
+bool TaskBuffer::takeFromLane(std::size_t worker, std::size_t lane, Task& out) {
+	{
+		// newest first, its data is more likely to still be in cache
+		Worker& w = *workers[worker];
+		std::lock_guard<std::mutex> lk(w.taskLock);
+		auto& tasks = w.tasks[lane];
+		if (!tasks.empty()) {
+			out = tasks.popBack();
+			--lanes[lane].queued;
+			return true;
+		}
+	}
+
+	// steal the oldest task from someone else
+	for (sz_t i = 1; i < workers.size(); i++) {
+		Worker& v = *workers[(worker + i) % workers.size()];
+		std::lock_guard<std::mutex> lk(v.taskLock);
+		auto& tasks = v.tasks[lane];
+		if (!tasks.empty()) {
+			out = tasks.popFront();
+			--lanes[lane].queued;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool TaskBuffer::hasRunnableTask() const {
+	for (const auto& ln : lanes) {
+		if (ln.queued > 0 && ln.running < ln.maxRunning) {
+			return true;
 		}
+	}
+
+	return false;
+}
+
+void TaskBuffer::runInMainThread(Task func) {
+	pushMainThreadTask(takeMainNode(std::move(func)));
+}
+
+TaskBuffer::MainNode * TaskBuffer::takeMainNode(Task func) {
+	static thread_local MainNodeCache cache;
+	if (!cache.head) {
+		// taking all of them means no ABA, the main thread is the only one pushing
+		cache.head = freeMainNodes.exchange(nullptr, std::memory_order_acquire);
+	}
+
+	MainNode * n = cache.head;
+	if (!n) {
+		return new MainNode{{}, std::move(func), true};
+	}
+
+	cache.head = MainNodeCache::next(n);
+	n->task = std::move(func);
+	return n;
+}
+
+void TaskBuffer::recycleMainNode(MainNode * n) {
+	if (mtTaskCount > maxRecycledMainNodes) {
+		delete n;
+		return;
+	}
 
-	} while (shouldRun.test_and_set());
+	MainNode * head = freeMainNodes.load(std::memory_order_relaxed);
+	do {
+		n->mpscNext.store(head, std::memory_order_relaxed);
+	} while (!freeMainNodes.compare_exchange_weak(head, n, std::memory_order_release, std::memory_order_relaxed));
+}
 
-	shouldRun.clear(); // notify another thread
-	cv.notify_one(); // just in case it is waiting
+void TaskBuffer::pushMainThreadTask(MainNode * n) {
+	// counted before the push, so the consumer can't see the count drop to 0 with this node
+	// still queued. if it sees the count before the node, it sends again after its run
+	bool wasEmpty = mtTaskCount.fetch_add(1) == 0;
+	mtTasks.push(n);
+	if (wasEmpty) {
+		execCaller->send();
+	}
 }
 
-void TaskBuffer::runInMainThread(std::function<void(TaskBuffer &)> func) {
+void TaskBuffer::queue(Task func) {
+	queue(Priority::NORMAL, std::move(func));
+}
+
+void TaskBuffer::queue(Priority prio, Task func) {
+	sz_t lane = static_cast<sz_t>(prio);
+	sz_t i = currentWorker.tb == this
+		? currentWorker.worker
+		: nextWorker.fetch_add(1, std::memory_order_relaxed) % workers.size();
+
 	{
-		std::lock_guard<std::mutex> lk(mtTaskLock);
-		mtTasks.emplace_back(std::move(func));
+		Worker& w = *workers[i];
+		std::lock_guard<std::mutex> lk(w.taskLock);
+		w.tasks[lane].pushBack(std::move(func));
+		++lanes[lane].queued; // under the deque's lock so it can't be taken before this
 	}
 
-	execCaller->send();
+	if (sleepingWorkers > 0) {
+		// a worker could be between its check and the wait, the lock waits it out
+		{ std::lock_guard<std::mutex> lk(cvLock); }
+		cv.notify_one();
+	}
 }
 
-void TaskBuffer::queue(std::function<void(TaskBuffer &)> func) {
+TaskBuffer::MainAwaiter TaskBuffer::switchToMain() {
+	return MainAwaiter(*this);
+}
+
+TaskBuffer::ThreadAwaiter TaskBuffer::switchToThread(Priority prio) {
+	return ThreadAwaiter(*this, prio);
+}
+
+void TaskBuffer::setLaneLimits(Priority prio, std::size_t maxRunning, std::uint32_t weight) {
+	Lane& ln = lanes[static_cast<sz_t>(prio)];
 	{
-		std::lock_guard<std::mutex> lk(taskLock);
-		asyncTasks.emplace_back(std::move(func));
+		std::lock_guard<std::mutex> lk(cvLock);
+		ln.maxRunning = std::max<sz_t>(1, maxRunning);
+		ln.weight = std::max<u32>(1, weight);
+	}
+
+	// a raised limit may let sleeping workers run queued tasks
+	cv.notify_all();
+}
+
+std::size_t TaskBuffer::queuedTasks(Priority prio) const {
+	return lanes[static_cast<sz_t>(prio)].queued;
+}
+
+std::size_t TaskBuffer::runningTasks(Priority prio) const {
+	return lanes[static_cast<sz_t>(prio)].running;
+}
+
+void TaskBuffer::setMainThreadBudget(std::chrono::microseconds budget) {
+	mtBudget = budget;
+}
+
+bool TaskBuffer::isWorkerThread() const {
+	return currentWorker.tb == this;
+}
+
+std::shared_ptr<TaskBuffer::ParallelJob> TaskBuffer::startParallel(std::size_t begin, std::size_t end, std::size_t grain,
+		ChunkFn fn, void * ctx, Priority prio, std::coroutine_handle<> waiter, std::exception_ptr * errorOut, bool participate) {
+	sz_t n = end - begin;
+	// a few chunks per thread, so uneven chunks even out
+	sz_t chunks = std::min((n + std::max<sz_t>(1, grain) - 1) / std::max<sz_t>(1, grain), (workers.size() + 1) * 4);
+	sz_t chunkSize = (n + chunks - 1) / chunks;
+	chunks = (n + chunkSize - 1) / chunkSize;
+
+	auto job = std::make_shared<ParallelJob>();
+	job->fn = fn;
+	job->ctx = ctx;
+	job->begin = begin;
+	job->end = end;
+	job->chunkSize = chunkSize;
+	job->chunks = chunks;
+	job->nextChunk = 0;
+	job->unfinished = chunks;
+	job->failed = false;
+	job->waiter = waiter;
+	job->errorOut = errorOut;
+
+	// helpers that find nothing left to do just return
+	sz_t helpers = std::min(participate ? chunks - 1 : chunks, workers.size());
+	for (sz_t i = 0; i < helpers; i++) {
+		queue(prio, [job] (TaskBuffer&) {
+			if (job->runChunks()) {
+				job->complete();
+			}
+		});
+	}
+
+	return job;
+}
+
+void TaskBuffer::runParallel(std::size_t begin, std::size_t end, std::size_t grain, ChunkFn fn, void * ctx, Priority prio) {
+	if (begin >= end) {
+		return;
+	}
+
+	auto job = startParallel(begin, end, grain, fn, ctx, prio, nullptr, nullptr, true);
+	job->runChunks();
+
+	// the rest are already running on other threads
+	sz_t left;
+	while ((left = job->unfinished.load(std::memory_order_acquire)) != 0) {
+		job->unfinished.wait(left, std::memory_order_acquire);
+	}
+
+	if (job->error) {
+		std::rethrow_exception(job->error);
+	}
+}
+
+TaskBuffer::Task::Task()
+: ops(nullptr) { }
+
+TaskBuffer::Task::Task(std::coroutine_handle<> h)
+: Task([h] (TaskBuffer&) { h.resume(); }) { }
+
+TaskBuffer::Task::Task(Task&& o) noexcept
+: ops(o.ops) {
+	if (ops) {
+		ops->move(storage, o.storage);
+		o.ops = nullptr;
+	}
+}
+
+TaskBuffer::Task& TaskBuffer::Task::operator=(Task&& o) noexcept {
+	if (this != &o) {
+		reset();
+		if (o.ops) {
+			o.ops->move(storage, o.storage);
+			ops = o.ops;
+			o.ops = nullptr;
+		}
 	}
 
-	cv.notify_one();
+	return *this;
 }
 
-Defer TaskBuffer::switchToMain() {
-	return Defer{[this](std::coroutine_handle<> h) {
-		// queue resumption of this handle on the main thread
-		runInMainThread([h{std::move(h)}](TaskBuffer&) { h.resume(); });
-	}};
+TaskBuffer::Task::~Task() {
+	reset();
 }
 
-Defer TaskBuffer::switchToThread() {
-	return Defer{[this](std::coroutine_handle<> h) {
-		// queue resumption of this handle on some thread
-		queue([h{std::move(h)}](TaskBuffer&) { h.resume(); });
-	}};
+void TaskBuffer::Task::operator()(TaskBuffer& tb) {
+	ops->invoke(storage, tb);
+}
+
+TaskBuffer::Task::operator bool() const {
+	return ops != nullptr;
+}
+
+void TaskBuffer::Task::reset() {
+	if (ops) {
+		ops->destroy(storage);
+		ops = nullptr;
+	}
+}
+
+TaskBuffer::MainAwaiter::MainAwaiter(TaskBuffer& tb)
+: tb(tb),
+  node{{}, {}, false} { }
+
+bool TaskBuffer::MainAwaiter::await_ready() const noexcept {
+	return false;
+}
+
+void TaskBuffer::MainAwaiter::await_suspend(std::coroutine_handle<> h) {
+	node.task = Task(h);
+	tb.pushMainThreadTask(&node);
+}
+
+void TaskBuffer::MainAwaiter::await_resume() { }
+
+TaskBuffer::ThreadAwaiter::ThreadAwaiter(TaskBuffer& tb, Priority prio)
+: tb(tb),
+  prio(prio) { }
+
+bool TaskBuffer::ThreadAwaiter::await_ready() const noexcept {
+	return false;
+}
+
+void TaskBuffer::ThreadAwaiter::await_suspend(std::coroutine_handle<> h) {
+	tb.queue(prio, Task(h));
+}
+
+void TaskBuffer::ThreadAwaiter::await_resume() { }
+
+TaskBuffer::ParallelAwaiter::ParallelAwaiter(TaskBuffer& tb, std::size_t begin, std::size_t end, std::size_t grain, Priority prio)
+: tb(tb),
+  begin(begin),
+  end(end),
+  grain(grain),
+  prio(prio) { }
+
+bool TaskBuffer::ParallelAwaiter::await_ready() const noexcept {
+	return begin >= end;
+}
+
+bool TaskBuffer::ParallelAwaiter::suspend(std::coroutine_handle<> h, ChunkFn fn, void * ctx) {
+	// nothing in this awaiter can be touched after startParallel() unless this thread
+	// finished the last chunk, the coroutine may be resumed and the awaiter gone by then
+	bool participate = tb.isWorkerThread();
+	auto job = tb.startParallel(begin, end, grain, fn, ctx, prio, h, &error, participate);
+	if (participate && job->runChunks()) {
+		error = job->error;
+		return false; // the last chunk finished here, continue without suspending
+	}
+
+	return true;
+}
+
+void TaskBuffer::ParallelAwaiter::rethrow() {
+	if (error) {
+		std::rethrow_exception(error);
+	}
 }
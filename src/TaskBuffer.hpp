@@ -1,6 +1,13 @@
 #pragma once
 
-#include <functional>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <coroutine>
+#include <exception>
+#include <ranges>
+#include <type_traits>
 #include <vector>
 #include <condition_variable>
 #include <mutex>
@@ -10,17 +17,58 @@
 
 #include "Poll.hpp"
 #include "async.hpp"
+#include "MpscQueue.hpp"
 
 class TaskBuffer {
+public:
+	/* Lanes are picked by weight (8/4/1 by default), and each can be
+	 * limited to a number of workers so background work can't take them all */
+	enum class Priority : std::uint8_t {
+		HIGH,
+		NORMAL,
+		LOW
+	};
+
+	static constexpr std::size_t numLanes = 3;
+
+	class Task;
+	class MainAwaiter;
+	class ThreadAwaiter;
+	class ParallelAwaiter;
+	template<typename Fn>
+	class ParallelForAwaiter;
+	template<typename V, typename Fn>
+	class ParallelMapAwaiter;
+
+	template<typename R, typename Fn>
+	using MapResult = std::vector<std::remove_cvref_t<std::invoke_result_t<Fn&, std::ranges::range_reference_t<const R>>>>;
+
+private:
+	struct Lane {
+		std::atomic<std::size_t> queued;
+		std::atomic<std::size_t> running;
+		std::atomic<std::size_t> maxRunning;
+		std::atomic<std::uint32_t> weight;
+	};
+
+	struct Worker; /* Defined in TaskBuffer.cpp */
+	struct MainNode;
+	struct MainNodeCache; /* Defined in TaskBuffer.cpp */
+	struct ParallelJob; /* Defined in TaskBuffer.cpp */
+	using ChunkFn = void (*)(void * ctx, std::size_t begin, std::size_t end);
+
 	std::unique_ptr<nev::Async> execCaller;
-	std::vector<std::thread> workers; // spawns one thread per core
-	std::atomic_flag shouldRun;
+	std::vector<std::unique_ptr<Worker>> workers; // spawns one thread per core
+	std::array<Lane, numLanes> lanes;
+	std::atomic<bool> shouldRun;
+	std::atomic<std::size_t> sleepingWorkers;
+	std::atomic<std::size_t> nextWorker; /* Round robin for tasks queued from other threads */
 	std::condition_variable cv;
 	std::mutex cvLock;
-	std::mutex mtTaskLock; /* For main thread tasks */
-	std::mutex taskLock; /* For async tasks */
-	std::vector<std::function<void(TaskBuffer &)>> mtTasks; /* Functions to be run in the main thread */
-	std::vector<std::function<void(TaskBuffer &)>> asyncTasks; /* Expensive functions (run on another thread) */
+	std::atomic<std::size_t> mtTaskCount; /* The Async is only sent when this goes up from 0 */
+	MpscQueue<MainNode> mtTasks; /* Functions to be run in the main thread */
+	std::atomic<MainNode *> freeMainNodes; /* Run by the main thread, producers take the whole list at once */
+	std::chrono::microseconds mtBudget;
 
 public:
 	TaskBuffer(nev::Loop&, std::size_t numWorkers = std::thread::hardware_concurrency());
@@ -34,14 +82,182 @@ public:
 	void setWorkerThreadsSchedulingPriorityToLowestPossibleValueAllowedByTheOperatingSystem();
 
 	/* Thread safe */
-	void runInMainThread(std::function<void(TaskBuffer &)>);
-	void queue(std::function<void(TaskBuffer &)>);
+	void runInMainThread(Task);
+	void queue(Task); // NORMAL priority
+	void queue(Priority, Task);
+
+	/* also thread safe, coro equivalent to functions above. these don't allocate */
+	MainAwaiter switchToMain();
+	ThreadAwaiter switchToThread(Priority = Priority::NORMAL);
+
+	/* Thread safe. maxRunning is clamped to at least 1 */
+	void setLaneLimits(Priority, std::size_t maxRunning, std::uint32_t weight);
+	std::size_t queuedTasks(Priority) const;
+	std::size_t runningTasks(Priority) const;
+
+	/* Main thread only. Main thread tasks left over after running this long
+	 * wait for the next loop iteration, so other events get handled. 0 means no limit */
+	void setMainThreadBudget(std::chrono::microseconds);
+
+	/* Runs fn(i) for every i in [begin, end), split into chunks of at least grain
+	 * indices, a few per worker. The calling thread runs chunks too, so this can't
+	 * deadlock when called from a worker. The first exception thrown by fn is
+	 * rethrown once all chunks are done, chunks not started by then are skipped */
+	template<typename Fn>
+	void parallelFor(std::size_t begin, std::size_t end, std::size_t grain, Fn&& fn, Priority = Priority::NORMAL);
+	/* Returns fn(x) for each x in a random access range, in order. The results
+	 * must be default constructible, and not bool (std::vector<bool> packs bits,
+	 * chunks on different threads would write to the same word) */
+	template<typename R, typename Fn>
+	MapResult<R, Fn> parallelMap(const R&, std::size_t grain, Fn&& fn, Priority = Priority::NORMAL);
+
+	/* co_await equivalents. The awaiting thread only runs chunks if it's one of the
+	 * workers, so awaiting on the main thread doesn't block the loop. The coroutine
+	 * is resumed by whichever thread finishes the last chunk. The awaiter may be
+	 * stored before awaiting it, parallelMapAsync keeps temporary ranges alive */
+	template<typename Fn>
+	ParallelForAwaiter<std::decay_t<Fn>> parallelForAsync(std::size_t begin, std::size_t end, std::size_t grain, Fn&& fn, Priority = Priority::NORMAL);
+	template<typename R, typename Fn>
+	ParallelMapAwaiter<std::views::all_t<R>, std::decay_t<Fn>> parallelMapAsync(R&&, std::size_t grain, Fn&& fn, Priority = Priority::NORMAL);
+
+private:
+	void executeMainThreadTasks(std::chrono::microseconds budget);
+	void executeTasks(std::size_t worker);
+	void pushMainThreadTask(MainNode *);
+	MainNode * takeMainNode(Task);
+	void recycleMainNode(MainNode *);
+	bool takeTask(std::size_t worker, Task&, std::size_t& lane);
+	bool takeFromLane(std::size_t worker, std::size_t lane, Task&);
+	bool hasRunnableTask() const;
+	bool isWorkerThread() const;
+	std::shared_ptr<ParallelJob> startParallel(std::size_t begin, std::size_t end, std::size_t grain,
+		ChunkFn, void * ctx, Priority, std::coroutine_handle<> waiter, std::exception_ptr * errorOut, bool participate);
+	void runParallel(std::size_t begin, std::size_t end, std::size_t grain, ChunkFn, void * ctx, Priority);
+};
+
+/* Move-only void(TaskBuffer&) callable. Small ones, like coroutine handles
+ * or lambdas with a few captures, are stored without allocating */
+class TaskBuffer::Task {
+	static constexpr std::size_t inlineSize = 6 * sizeof(void *);
+
+	struct Ops {
+		void (*invoke)(void *, TaskBuffer&);
+		void (*move)(void * to, void * from); // also destroys from
+		void (*destroy)(void *);
+	};
+
+	template<typename Fn>
+	static constexpr bool fitsInline = sizeof(Fn) <= inlineSize
+		&& alignof(Fn) <= alignof(std::max_align_t)
+		&& std::is_nothrow_move_constructible_v<Fn>;
+
+	template<typename Fn>
+	static const Ops inlineOps;
+	template<typename Fn>
+	static const Ops heapOps;
+
+	alignas(std::max_align_t) unsigned char storage[inlineSize];
+	const Ops * ops;
+
+public:
+	Task();
+	Task(std::coroutine_handle<>); // resumes it
 
-	/* also thread safe, coro equivalent to functions above */
-	Defer switchToMain();
-	Defer switchToThread();
+	template<typename F, typename = std::enable_if_t<
+		std::is_invocable_v<std::decay_t<F>&, TaskBuffer&>
+		&& !std::is_same_v<std::decay_t<F>, Task>>>
+	Task(F&&);
+
+	Task(Task&&) noexcept;
+	Task& operator=(Task&&) noexcept;
+	~Task();
+
+	// this object isn't touched after the callable returns, so it may destroy it
+	void operator()(TaskBuffer&);
+	explicit operator bool() const;
 
 private:
-	void executeMainThreadTasks();
-	void executeTasks();
+	void reset();
+};
+
+struct TaskBuffer::MainNode : MpscNode {
+	Task task;
+	bool owned; /* Allocated by runInMainThread, recycled after running */
 };
+
+class TaskBuffer::MainAwaiter {
+	TaskBuffer& tb;
+	MainNode node; /* Lives in the coroutine frame while suspended */
+
+public:
+	MainAwaiter(TaskBuffer&);
+
+	bool await_ready() const noexcept;
+	void await_suspend(std::coroutine_handle<> h);
+	void await_resume();
+};
+
+class TaskBuffer::ThreadAwaiter {
+	TaskBuffer& tb;
+	Priority prio;
+
+public:
+	ThreadAwaiter(TaskBuffer&, Priority);
+
+	bool await_ready() const noexcept;
+	void await_suspend(std::coroutine_handle<> h);
+	void await_resume();
+};
+
+class TaskBuffer::ParallelAwaiter {
+	TaskBuffer& tb;
+	std::size_t begin;
+	std::size_t end;
+	std::size_t grain;
+	Priority prio;
+	std::exception_ptr error;
+
+protected:
+	ParallelAwaiter(TaskBuffer&, std::size_t begin, std::size_t end, std::size_t grain, Priority);
+
+	bool suspend(std::coroutine_handle<>, ChunkFn, void * ctx);
+	void rethrow();
+
+public:
+	bool await_ready() const noexcept;
+};
+
+template<typename Fn>
+class TaskBuffer::ParallelForAwaiter : public ParallelAwaiter {
+	Fn fn;
+
+public:
+	ParallelForAwaiter(TaskBuffer&, std::size_t begin, std::size_t end, std::size_t grain, Fn, Priority);
+
+	bool await_suspend(std::coroutine_handle<> h);
+	void await_resume();
+
+private:
+	static void runChunk(void *, std::size_t begin, std::size_t end);
+};
+
+/* V is a view of the range, owning it if it was an rvalue */
+template<typename V, typename Fn>
+class TaskBuffer::ParallelMapAwaiter : public ParallelAwaiter {
+	V range;
+	Fn fn;
+	MapResult<V, Fn> results;
+
+	static_assert(!std::is_same_v<typename MapResult<V, Fn>::value_type, bool>, "parallelMapAsync can't return bool, wrap it");
+
+public:
+	ParallelMapAwaiter(TaskBuffer&, V, std::size_t grain, Fn, Priority);
+
+	bool await_suspend(std::coroutine_handle<> h);
+	MapResult<V, Fn> await_resume();
+
+private:
+	static void runChunk(void *, std::size_t begin, std::size_t end);
+};
+
+#include "TaskBuffer.tpp" // IWYU pragma: keep
@@ -0,0 +1,114 @@
+#include "TaskBuffer.hpp"
+
+#include <new>
+#include <utility>
+
+template<typename Fn>
+const TaskBuffer::Task::Ops TaskBuffer::Task::inlineOps = {
+	[] (void * s, TaskBuffer& tb) { (*static_cast<Fn *>(s))(tb); },
+	[] (void * to, void * from) {
+		::new (to) Fn(std::move(*static_cast<Fn *>(from)));
+		static_cast<Fn *>(from)->~Fn();
+	},
+	[] (void * s) { static_cast<Fn *>(s)->~Fn(); }
+};
+
+template<typename Fn>
+const TaskBuffer::Task::Ops TaskBuffer::Task::heapOps = {
+	[] (void * s, TaskBuffer& tb) { (**static_cast<Fn **>(s))(tb); },
+	[] (void * to, void * from) { *static_cast<Fn **>(to) = *static_cast<Fn **>(from); },
+	[] (void * s) { delete *static_cast<Fn **>(s); }
+};
+
+template<typename F, typename>
+TaskBuffer::Task::Task(F&& f) {
+	using Fn = std::decay_t<F>;
+	if constexpr (fitsInline<Fn>) {
+		::new (static_cast<void *>(storage)) Fn(std::forward<F>(f));
+		ops = &inlineOps<Fn>;
+	} else {
+		::new (static_cast<void *>(storage)) Fn *(new Fn(std::forward<F>(f)));
+		ops = &heapOps<Fn>;
+	}
+}
+
+template<typename Fn>
+void TaskBuffer::parallelFor(std::size_t begin, std::size_t end, std::size_t grain, Fn&& fn, Priority prio) {
+	runParallel(begin, end, grain, [] (void * f, std::size_t b, std::size_t e) {
+		for (; b < e; b++) {
+			(*static_cast<std::remove_reference_t<Fn> *>(f))(b);
+		}
+	}, static_cast<void *>(std::addressof(fn)), prio);
+}
+
+template<typename R, typename Fn>
+TaskBuffer::MapResult<R, Fn> TaskBuffer::parallelMap(const R& range, std::size_t grain, Fn&& fn, Priority prio) {
+	static_assert(!std::is_same_v<typename MapResult<R, Fn>::value_type, bool>, "parallelMap can't return bool, wrap it");
+	auto first = std::ranges::begin(range);
+	MapResult<R, Fn> results(std::ranges::size(range));
+	parallelFor(0, results.size(), grain, [&] (std::size_t i) {
+		results[i] = fn(first[i]);
+	}, prio);
+
+	return results;
+}
+
+template<typename Fn>
+TaskBuffer::ParallelForAwaiter<std::decay_t<Fn>> TaskBuffer::parallelForAsync(std::size_t begin, std::size_t end, std::size_t grain, Fn&& fn, Priority prio) {
+	return {*this, begin, end, grain, std::forward<Fn>(fn), prio};
+}
+
+template<typename R, typename Fn>
+TaskBuffer::ParallelMapAwaiter<std::views::all_t<R>, std::decay_t<Fn>> TaskBuffer::parallelMapAsync(R&& range, std::size_t grain, Fn&& fn, Priority prio) {
+	return {*this, std::views::all(std::forward<R>(range)), grain, std::forward<Fn>(fn), prio};
+}
+
+template<typename Fn>
+TaskBuffer::ParallelForAwaiter<Fn>::ParallelForAwaiter(TaskBuffer& tb, std::size_t begin, std::size_t end, std::size_t grain, Fn fn, Priority prio)
+: ParallelAwaiter(tb, begin, end, grain, prio),
+  fn(std::move(fn)) { }
+
+template<typename Fn>
+bool TaskBuffer::ParallelForAwaiter<Fn>::await_suspend(std::coroutine_handle<> h) {
+	return suspend(h, &runChunk, this);
+}
+
+template<typename Fn>
+void TaskBuffer::ParallelForAwaiter<Fn>::await_resume() {
+	rethrow();
+}
+
+template<typename Fn>
+void TaskBuffer::ParallelForAwaiter<Fn>::runChunk(void * self, std::size_t b, std::size_t e) {
+	Fn& f = static_cast<ParallelForAwaiter *>(self)->fn;
+	for (; b < e; b++) {
+		f(b);
+	}
+}
+
+template<typename V, typename Fn>
+TaskBuffer::ParallelMapAwaiter<V, Fn>::ParallelMapAwaiter(TaskBuffer& tb, V range, std::size_t grain, Fn fn, Priority prio)
+: ParallelAwaiter(tb, 0, std::ranges::size(range), grain, prio),
+  range(std::move(range)),
+  fn(std::move(fn)),
+  results(std::ranges::size(this->range)) { }
+
+template<typename V, typename Fn>
+bool TaskBuffer::ParallelMapAwaiter<V, Fn>::await_suspend(std::coroutine_handle<> h) {
+	return suspend(h, &runChunk, this);
+}
+
+template<typename V, typename Fn>
+TaskBuffer::MapResult<V, Fn> TaskBuffer::ParallelMapAwaiter<V, Fn>::await_resume() {
+	rethrow();
+	return std::move(results);
+}
+
+template<typename V, typename Fn>
+void TaskBuffer::ParallelMapAwaiter<V, Fn>::runChunk(void * self, std::size_t b, std::size_t e) {
+	auto& aw = *static_cast<ParallelMapAwaiter *>(self);
+	auto first = std::ranges::begin(std::as_const(aw.range)); // same element type as MapResult was computed with
+	for (; b < e; b++) {
+		aw.results[b] = aw.fn(first[b]);
+	}
+}
@@ -17,4 +17,10 @@ inline ll::shared_ptr<T> make_shared(Args&&... args) {
 		std::forward<Args>(args)...);
 }
 
+template<typename T, typename Alloc, typename... Args>
+inline ll::shared_ptr<T> allocate_shared(const Alloc& a, Args&&... args) {
+	return std::__allocate_shared<T, __gnu_cxx::_S_single>(a,
+		std::forward<Args>(args)...);
+}
+
 }
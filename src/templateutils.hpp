@@ -3,6 +3,7 @@
 #include <type_traits>
 #include <tuple>
 #include <array>
+#include <vector>
 #include <optional>
 
 // https://stackoverflow.com/a/30848101
@@ -47,6 +48,12 @@ struct is_std_array : std::false_type {};
 template<typename T, std::size_t N>
 struct is_std_array<std::array<T, N>> : std::true_type {};
 
+template<typename>
+struct is_vector : std::false_type {};
+
+template<typename T, typename A>
+struct is_vector<std::vector<T, A>> : std::true_type {};
+
 template<typename>
 struct is_tuple : std::false_type {};
 